@@ -1,7 +1,26 @@
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/version.h>
 #include <linux/sched.h>
+#include <linux/sched/signal.h>
+#include <linux/sched/task.h>
+#include <linux/kfifo.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/rcupdate.h>
+#include <linux/spinlock.h>
+#include <linux/tracepoint.h>
+#include <linux/pid_namespace.h>
+#include <linux/sched/mm.h>
+#include <linux/sort.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <linux/ctype.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/capability.h>
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Vedat Can Akin");
@@ -10,6 +29,15 @@ MODULE_VERSION("0.01");
 
 int PID = -1;
 char *traverseType = "-x";
+int maxTasks = 65536;
+bool shadow = true;
+int maxDepth = -1;
+char *commFilter = "";
+int uidFilter = -1;
+char *stateFilter = "";
+bool threads = false;
+bool prune = false;
+int rounds = 1;
 
 module_param(PID, int, 0000);
 MODULE_PARM_DESC(PID, "PID of a process");
@@ -17,115 +45,1399 @@ MODULE_PARM_DESC(PID, "PID of a process");
 module_param(traverseType, charp, 0000);
 MODULE_PARM_DESC(traverseType, "Type of the traversal");
 
-// void BFS(struct list_head *frontier);
-void BFS(struct task_struct *task);
-void DFS(struct task_struct *task);
-void visitTask(struct task_struct *task);
+module_param(maxTasks, int, 0000);
+MODULE_PARM_DESC(maxTasks, "Most processes copied from the task list");
+
+module_param(shadow, bool, 0000);
+MODULE_PARM_DESC(shadow, "Keep a shadow process tree from fork/exit tracepoints");
+
+module_param(maxDepth, int, 0000);
+MODULE_PARM_DESC(maxDepth, "Deepest level below PID visited, -1 for all");
+
+module_param_named(comm, commFilter, charp, 0000);
+MODULE_PARM_DESC(comm, "Only processes whose name contains this, ^name for a prefix");
+
+module_param_named(uid, uidFilter, int, 0000);
+MODULE_PARM_DESC(uid, "Only processes of this real uid, -1 for all");
+
+module_param_named(state, stateFilter, charp, 0000);
+MODULE_PARM_DESC(state, "Only processes in one of these states, like RD");
+
+module_param(threads, bool, 0000);
+MODULE_PARM_DESC(threads, "List the threads of every process");
+
+module_param(prune, bool, 0000);
+MODULE_PARM_DESC(prune, "Skip the whole subtree of a process the filters reject");
+
+module_param(rounds, int, 0000);
+MODULE_PARM_DESC(rounds, "Times each walk is repeated by traverseType -t, at most 1000");
+
+/**
+ * The process tree is copied out of the task list under rcu_read_lock and traversed afterwards,
+ * children and sibling lists of live tasks are only safe to walk under tasklist_lock,
+ * which modules cannot take
+ * Tree links are indexes into tasks, -1 for none, a free slot has pid 0
+ */
+struct task_record
+{
+    pid_t pid;
+    pid_t ppid;
+    char comm[TASK_COMM_LEN];
+    int parent;
+    int firstChild;
+    int lastChild;
+    int nextSibling;
+    int prevSibling;
+    int nextInBucket; // pid hash chain, or the free list for a free slot
+};
+
+struct process_tree
+{
+    struct task_record *tasks;
+    int capacity;
+    int taskCount;   // slots ever used, free ones below it are on freeList
+    int liveCount;   // slots holding a process
+    int missedCount; // processes past capacity
+    int *buckets;    // pid hash, heads of nextInBucket chains
+    int bucketCount; // power of two
+    int freeList;
+};
+
+/**
+ * Resources of one process and of its whole subtree, filled by -a
+ */
+struct task_usage
+{
+    char state;
+    int threads;
+    unsigned long rss; // kB
+    u64 utime, stime;  // ns
+    int subtreeProcesses;
+    int subtreeThreads;
+    unsigned long subtreeRss;
+    u64 subtreeUtime, subtreeStime;
+};
+
+struct usage_key
+{
+    u64 key;
+    int index;
+};
+
+/**
+ * What a traversal shows, from the module parameters for dmesg or from the /proc/pstraverse request
+ * An empty comm or states and a uid of -1 let every process through
+ */
+struct traversal_filter
+{
+    int maxDepth;
+    char comm[TASK_COMM_LEN + 1]; // room for the ^ of a prefix
+    int uid;
+    char states[16];
+    bool threads;
+    bool prune;
+};
+
+/**
+ * -t, what the snapshot and each walk cost, the walks summed over all rounds
+ */
+struct traversal_timing
+{
+    u64 snapshotNs, bfsNs, dfsNs;
+    int bfsCount, dfsCount;
+    int peakQueue; // most processes BFS had queued at once
+    int peakDepth; // deepest level DFS reached, the walk itself keeps no stack
+    bool fromShadow;
+};
+
+/**
+ * Scratch space of BFS, allocated once per traversal so that timed rounds only walk
+ * Every process is queued once, so a queue of taskCount entries never fills
+ */
+struct bfs_queue
+{
+    DECLARE_KFIFO_PTR(fifo, int);
+    int *depth;
+};
+
+struct thread_record
+{
+    pid_t tid;
+    char comm[TASK_COMM_LEN];
+};
+
+/**
+ * One traversal, PID and traverseType for dmesg or what was written to /proc/pstraverse
+ * order lists the visited tasks, a trailing -1 stands for the missed processes
+ * and -2 - index into threadRecords for a thread listed after its process
+ * shown marks the visited tasks the filter let through, the others are only walked past
+ * -a adds usage, sorted by sortKey and cut to the top processes when top is not 0
+ * -v compares the shadow tree against a fresh walk, order then lists the differences:
+ * indexes into tree for processes the shadow tree has wrong, -2 - index into shadowCopy for stale ones
+ * -t times BFS and DFS over top rounds instead, order then is 0, 1, 2 for the snapshot, BFS and DFS lines
+ */
+struct traversal
+{
+    pid_t pid;
+    char mode[4];
+    int top;
+    char sortKey[8];
+    struct traversal_filter filter;
+    struct traversal_timing timing;
+    struct process_tree tree;
+    struct process_tree shadowCopy;
+    struct task_usage *usage;
+    struct thread_record *threadRecords;
+    int threadCount;
+    bool *shown;
+    int *order;
+    int orderCount;
+    int mismatchCount;
+};
+
+#define PROC_NAME "pstraverse"
+#define REQUEST_SIZE 128
+#define LINE_SIZE 256
+#define MAX_ROUNDS 1000 // -t rounds, a request cannot keep the kernel walking for hours
+
+/**
+ * Shadow tree, kept up to date by the probes below while the module is loaded
+ * so traversals copy it instead of walking the task list
+ * shadowBroken is set when it could not follow a change, traversals walk again from then on
+ * shadowGeneration counts the changes, so a walk done without the lock can tell whether it raced one
+ * Nothing takes task_lock under shadowLock: names are copied without it, like get_task_comm() in newer kernels
+ */
+struct process_tree shadowTree;
+DEFINE_SPINLOCK(shadowLock);
+bool shadowActive;
+bool shadowBroken;
+u64 shadowGeneration;
+
+/**
+ * task_rename fires with task_lock held, so probeRename does not take shadowLock:
+ * it queues the new name under renameLock, which nothing is taken under, and lockShadow() applies the queue
+ */
+#define RENAME_QUEUE_SIZE 64
+#define VERIFY_ATTEMPTS 8
+
+struct pending_rename
+{
+    pid_t pid;
+    char comm[TASK_COMM_LEN];
+};
+
+struct pending_rename renameQueue[RENAME_QUEUE_SIZE];
+int renameCount;
+bool renameOverflow;
+DEFINE_SPINLOCK(renameLock);
+struct tracepoint *forkTracepoint, *exitTracepoint, *execTracepoint, *renameTracepoint;
+
+int initTree(struct process_tree *tree, int capacity);
+void freeTree(struct process_tree *tree);
+int findTask(struct process_tree *tree, pid_t pid);
+int insertTask(struct process_tree *tree, pid_t pid, pid_t ppid, const char *comm);
+void linkTask(struct process_tree *tree, int i, int parent);
+void unlinkTask(struct process_tree *tree, int i);
+void removeTask(struct process_tree *tree, int i);
+void fillSnapshot(struct process_tree *tree, bool liveOnly);
+void lockShadow(void);
+int takeSnapshot(struct process_tree *tree);
+int copyShadow(struct process_tree *tree);
+int startShadow(void);
+void stopShadow(void);
+bool visitTask(struct traversal *traversal, int i, int depth);
+int initQueue(struct bfs_queue *queue, int capacity);
+void freeQueue(struct bfs_queue *queue);
+int BFS(struct traversal *traversal, int root, struct bfs_queue *queue);
+int DFS(struct traversal *traversal, int root);
+int runTraversal(struct traversal *traversal);
+int runVerify(struct traversal *traversal);
+int runUsage(struct traversal *traversal);
+int runTiming(struct traversal *traversal);
+void keepShown(struct traversal *traversal);
+int addThreads(struct traversal *traversal);
+void formatLine(struct traversal *traversal, int i, char *line);
+void freeTraversal(struct traversal *traversal);
+
+extern const struct seq_operations pstraverse_seq_ops;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+extern const struct proc_ops pstraverse_proc_ops;
+#else
+extern const struct file_operations pstraverse_proc_ops;
+#endif
 
 static int __init my_module_init(void)
 {
     printk(KERN_INFO "Module inserted!\n");
+    if (maxTasks < 1)
+        maxTasks = 1;
+
+    if (shadow && startShadow() != 0)
+        printk(KERN_INFO "Shadow tree unavailable, traversals walk the task list!\n");
+
+    /**
+     * Stays loaded serving /proc/pstraverse, PID only asks for one traversal in dmesg
+     */
+    if (proc_create(PROC_NAME, 0644, NULL, &pstraverse_proc_ops) == NULL)
+    {
+        stopShadow();
+        return -ENOMEM;
+    }
+
     if (!(PID < 0))
     {
-        struct task_struct *task = get_pid_task(find_get_pid(PID), PIDTYPE_PID);
-        if (task == NULL)
-        {
-            printk(KERN_INFO "Invalid PID!\n");
-            return 0;
-        }
-        if (strcmp(traverseType, "-b") == 0)
-        {
-            BFS(task);
-        }
+        struct traversal traversal = {.pid = PID, .sortKey = "cpu"};
+        int i, err;
+        strscpy(traversal.mode, traverseType, sizeof(traversal.mode));
+        traversal.filter.maxDepth = maxDepth;
+        traversal.filter.uid = uidFilter;
+        traversal.filter.threads = threads;
+        traversal.filter.prune = prune;
+        strscpy(traversal.filter.comm, commFilter, sizeof(traversal.filter.comm));
+        strscpy(traversal.filter.states, stateFilter, sizeof(traversal.filter.states));
+        if (strcmp(traversal.mode, "-t") == 0)
+            traversal.top = rounds;
 
-        else if (strcmp(traverseType, "-d") == 0)
+        err = runTraversal(&traversal);
+        if (err == -ESRCH)
+            printk(KERN_INFO "Invalid PID!\n");
+        else if (err == -ENOMEM)
+            printk(KERN_INFO "Not enough memory for %d processes!\n", maxTasks);
+        for (i = 0; i < traversal.orderCount; i++)
         {
-            DFS(task);
+            char line[LINE_SIZE];
+            formatLine(&traversal, traversal.order[i], line);
+            printk(KERN_INFO "%s", line);
         }
+        freeTraversal(&traversal);
     }
     return 0;
 }
 static void __exit my_module_exit(void)
 {
+    remove_proc_entry(PROC_NAME, NULL);
+    stopShadow();
     printk(KERN_INFO "Module removed!\n");
 }
-void BFS(struct task_struct *task)
+
+int initTree(struct process_tree *tree, int capacity)
+{
+    int i;
+    tree->capacity = capacity;
+    tree->bucketCount = roundup_pow_of_two(capacity);
+    tree->tasks = kvmalloc_array(capacity, sizeof(struct task_record), GFP_KERNEL);
+    tree->buckets = kvmalloc_array(tree->bucketCount, sizeof(int), GFP_KERNEL);
+    if (tree->tasks == NULL || tree->buckets == NULL)
+    {
+        freeTree(tree);
+        return -ENOMEM;
+    }
+    for (i = 0; i < tree->bucketCount; i++)
+        tree->buckets[i] = -1;
+    tree->taskCount = 0;
+    tree->liveCount = 0;
+    tree->missedCount = 0;
+    tree->freeList = -1;
+    return 0;
+}
+
+void freeTree(struct process_tree *tree)
 {
-    printk(KERN_INFO "BFS is not implemented!\n");
+    kvfree(tree->tasks);
+    kvfree(tree->buckets);
+    tree->tasks = NULL;
+    tree->buckets = NULL;
+    tree->taskCount = 0;
+    tree->liveCount = 0;
 }
 
-void DFS(struct task_struct *task)
+int findTask(struct process_tree *tree, pid_t pid)
 {
-    struct task_struct *child;
-    struct list_head *list;
-    visitTask(task);
+    int i;
+    for (i = tree->buckets[pid & (tree->bucketCount - 1)]; i != -1; i = tree->tasks[i].nextInBucket)
+        if (tree->tasks[i].pid == pid)
+            return i;
+    return -1;
+}
 
-    if (!list_empty(&task->children))
+int insertTask(struct process_tree *tree, pid_t pid, pid_t ppid, const char *comm)
+{
+    /**
+     * Adds an unlinked process, returns its index or -1 when the tree is full
+     */
+    struct task_record *task;
+    int i, bucket = pid & (tree->bucketCount - 1);
+    if (tree->freeList != -1)
     {
-        list_for_each(list, &task->children)
-        {
-            child = list_entry(list, struct task_struct, sibling);
-            DFS(child);
-        }
+        i = tree->freeList;
+        tree->freeList = tree->tasks[i].nextInBucket;
+    }
+    else if (tree->taskCount < tree->capacity)
+        i = tree->taskCount++;
+    else
+    {
+        tree->missedCount++;
+        return -1;
+    }
+
+    task = &tree->tasks[i];
+    task->pid = pid;
+    task->ppid = ppid;
+    memcpy(task->comm, comm, TASK_COMM_LEN);
+    task->parent = -1;
+    task->firstChild = -1;
+    task->lastChild = -1;
+    task->nextSibling = -1;
+    task->prevSibling = -1;
+    task->nextInBucket = tree->buckets[bucket];
+    tree->buckets[bucket] = i;
+    tree->liveCount++;
+    return i;
+}
+
+void linkTask(struct process_tree *tree, int i, int parent)
+{
+    /**
+     * Appends i to the children of parent, so children stay in fork order
+     */
+    struct task_record *task = &tree->tasks[i];
+    task->parent = parent;
+    if (parent == -1)
+        return;
+    task->ppid = tree->tasks[parent].pid;
+    task->prevSibling = tree->tasks[parent].lastChild;
+    if (task->prevSibling != -1)
+        tree->tasks[task->prevSibling].nextSibling = i;
+    else
+        tree->tasks[parent].firstChild = i;
+    tree->tasks[parent].lastChild = i;
+}
+
+void unlinkTask(struct process_tree *tree, int i)
+{
+    struct task_record *task = &tree->tasks[i];
+    if (task->parent != -1)
+    {
+        if (task->prevSibling != -1)
+            tree->tasks[task->prevSibling].nextSibling = task->nextSibling;
+        else
+            tree->tasks[task->parent].firstChild = task->nextSibling;
+        if (task->nextSibling != -1)
+            tree->tasks[task->nextSibling].prevSibling = task->prevSibling;
+        else
+            tree->tasks[task->parent].lastChild = task->prevSibling;
+    }
+    task->parent = -1;
+    task->nextSibling = -1;
+    task->prevSibling = -1;
+}
+
+void removeTask(struct process_tree *tree, int i)
+{
+    /**
+     * Frees a process whose children were already moved away
+     */
+    int *link = &tree->buckets[tree->tasks[i].pid & (tree->bucketCount - 1)];
+    unlinkTask(tree, i);
+    while (*link != i)
+        link = &tree->tasks[*link].nextInBucket;
+    *link = tree->tasks[i].nextInBucket;
+    tree->tasks[i].pid = 0;
+    tree->tasks[i].nextInBucket = tree->freeList;
+    tree->freeList = i;
+    tree->liveCount--;
+}
+
+void fillSnapshot(struct process_tree *tree, bool liveOnly)
+{
+    /**
+     * Copies every process into an empty tree and links each one under its parent
+     * Does not sleep, liveOnly skips processes whose last thread already exited
+     */
+    struct task_struct *task;
+    char comm[TASK_COMM_LEN];
+    int i;
+
+    rcu_read_lock();
+    for_each_process(task)
+    {
+        if (liveOnly && atomic_read(&task->signal->live) == 0)
+            continue;
+        strscpy_pad(comm, task->comm, TASK_COMM_LEN); // comm always ends in a NUL, a racing rename only mixes names
+        insertTask(tree, task->pid, task_tgid_nr(rcu_dereference(task->real_parent)), comm);
+    }
+    rcu_read_unlock();
+
+    // The task list is in fork order, so appending keeps children in that order
+    for (i = 0; i < tree->taskCount; i++)
+    {
+        struct task_record *record = &tree->tasks[i];
+        if (record->ppid != record->pid)
+            linkTask(tree, i, findTask(tree, record->ppid));
     }
 }
 
-void visitTask(struct task_struct *task)
+int takeSnapshot(struct process_tree *tree)
 {
-    printk(KERN_INFO "PID: %d, Name: %s\n", task->pid, task->comm);
+    if (initTree(tree, maxTasks) != 0)
+        return -ENOMEM;
+    fillSnapshot(tree, false);
+    return 0;
+}
+
+int copyShadow(struct process_tree *tree)
+{
+    /**
+     * Copies the shadow tree into memory allocated before shadowLock is taken
+     * Returns -EAGAIN when there is no shadow tree to trust
+     */
+    if (initTree(tree, maxTasks) != 0)
+        return -ENOMEM;
+    lockShadow();
+    if (!shadowActive || shadowBroken)
+    {
+        spin_unlock(&shadowLock);
+        freeTree(tree);
+        return -EAGAIN;
+    }
+    memcpy(tree->tasks, shadowTree.tasks, shadowTree.taskCount * sizeof(struct task_record));
+    memcpy(tree->buckets, shadowTree.buckets, shadowTree.bucketCount * sizeof(int));
+    tree->taskCount = shadowTree.taskCount;
+    tree->liveCount = shadowTree.liveCount;
+    tree->freeList = shadowTree.freeList;
+    spin_unlock(&shadowLock);
+    return 0;
 }
 
 /**
-void BFS(struct list_head *frontier)
+ * Probes, called by the tracepoints in the task that forks, execs, renames itself or exits
+ * Only processes are tracked, threads belong to their thread group leader
+ */
+static void probeFork(void *data, struct task_struct *parent, struct task_struct *child)
+{
+    char comm[TASK_COMM_LEN];
+    pid_t ppid;
+    int i;
+    if (!thread_group_leader(child))
+        return;
+    get_task_comm(comm, child);
+    rcu_read_lock();
+    ppid = task_tgid_nr(rcu_dereference(child->real_parent)); // CLONE_PARENT forks a sibling
+    rcu_read_unlock();
+
+    lockShadow();
+    shadowGeneration++;
+    if (findTask(&shadowTree, child->pid) == -1)
+    {
+        i = insertTask(&shadowTree, child->pid, ppid, comm);
+        if (i == -1)
+            shadowBroken = true;
+        else
+            linkTask(&shadowTree, i, findTask(&shadowTree, ppid));
+    }
+    spin_unlock(&shadowLock);
+}
+
+static pid_t findReaper(struct task_struct *task)
 {
-    struct task_struct *currentTask;
-    struct list_head *child;
-    struct list_head *nextFrontier;
-    struct list_head *list;
-    if (!list_empty(frontier))
+    /**
+     * The process that adopts the children of task, like find_new_reaper():
+     * the closest child subreaper above it that is still running, else the init of its namespace
+     */
+    struct task_struct *reaper, *init;
+    pid_t pid;
+    rcu_read_lock();
+    init = task_active_pid_ns(task)->child_reaper;
+    pid = task_tgid_nr(init);
+    if (task->signal->has_child_subreaper)
     {
-        list_for_each(list, frontier)
+        for (reaper = rcu_dereference(task->real_parent); reaper != init && reaper->pid > 1;
+             reaper = rcu_dereference(reaper->real_parent))
         {
-            currentTask = list_entry(list, struct task_struct, sibling);
-            if (currentTask == NULL)
+            if (reaper->signal->is_child_subreaper && atomic_read(&reaper->signal->live) > 0)
             {
-                printk(KERN_INFO "Something went wrong!\n");
+                pid = task_tgid_nr(reaper);
                 break;
             }
-            if (currentTask->pid != 0)
-            {
-                visitTask(currentTask);
-            }
         }
+    }
+    rcu_read_unlock();
+    return pid;
+}
 
-        list_for_each(list, frontier)
+static void probeExit(void *data, struct task_struct *task)
+{
+    /**
+     * Newer kernels pass group_dead after task, signal->live already says the same
+     */
+    pid_t reaper;
+    int i, child, next, adopter;
+    if (atomic_read(&task->signal->live) != 0) // other threads keep the process running
+        return;
+    reaper = findReaper(task);
+
+    lockShadow();
+    shadowGeneration++;
+    i = findTask(&shadowTree, task->tgid);
+    if (i != -1)
+    {
+        adopter = findTask(&shadowTree, reaper);
+        if (adopter == i)
+            adopter = -1;
+        for (child = shadowTree.tasks[i].firstChild; child != -1; child = next)
         {
-            currentTask = list_entry(list, struct task_struct, sibling);
-            if (!list_empty(&currentTask->children))
-            {
-                printk(KERN_INFO "It's not empty!\n");
-                // list_for_each(child, &currentTask->children)
-                // {
-                // //     //     // if (nextFrontier == NULL)
-                // //     //     // {
-                // //     //     //     nextFrontier = child;
-                // //     //     // }
-                // //     //     // else
-                // //     //     // {
-                // //     //     //     list_add(child, nextFrontier);
-                // //     //     // }
-                // }
-            }
-            else
+            next = shadowTree.tasks[child].nextSibling;
+            unlinkTask(&shadowTree, child);
+            linkTask(&shadowTree, child, adopter);
+        }
+        removeTask(&shadowTree, i);
+    }
+    spin_unlock(&shadowLock);
+}
+
+static void probeExec(void *data, struct task_struct *task, pid_t oldPid, struct linux_binprm *bprm)
+{
+    char comm[TASK_COMM_LEN];
+    int i;
+    get_task_comm(comm, task);
+    lockShadow();
+    shadowGeneration++;
+    i = findTask(&shadowTree, task->tgid);
+    if (i != -1)
+        memcpy(shadowTree.tasks[i].comm, comm, TASK_COMM_LEN);
+    spin_unlock(&shadowLock);
+}
+
+static void probeRename(void *data, struct task_struct *task, const char *comm)
+{
+    if (!thread_group_leader(task))
+        return;
+    spin_lock(&renameLock);
+    if (renameCount == RENAME_QUEUE_SIZE)
+        renameOverflow = true;
+    else
+    {
+        renameQueue[renameCount].pid = task->pid;
+        strscpy_pad(renameQueue[renameCount].comm, comm, TASK_COMM_LEN);
+        renameCount++;
+    }
+    spin_unlock(&renameLock);
+}
+
+void lockShadow(void)
+{
+    /**
+     * Takes shadowLock and applies the renames queued since the last time, oldest first
+     * A full queue lost a rename, so the shadow tree is no longer trusted
+     */
+    int k, i;
+    spin_lock(&shadowLock);
+    spin_lock(&renameLock);
+    for (k = 0; k < renameCount; k++)
+    {
+        i = findTask(&shadowTree, renameQueue[k].pid);
+        if (i != -1)
+            memcpy(shadowTree.tasks[i].comm, renameQueue[k].comm, TASK_COMM_LEN);
+    }
+    if (renameCount > 0 || renameOverflow)
+        shadowGeneration++;
+    if (renameOverflow)
+        shadowBroken = true;
+    renameCount = 0;
+    renameOverflow = false;
+    spin_unlock(&renameLock);
+}
+
+static void lookupTracepoint(struct tracepoint *tracepoint, void *priv)
+{
+    // The sched tracepoints are not exported to modules, they are found by name
+    if (strcmp(tracepoint->name, "sched_process_fork") == 0)
+        forkTracepoint = tracepoint;
+    else if (strcmp(tracepoint->name, "sched_process_exit") == 0)
+        exitTracepoint = tracepoint;
+    else if (strcmp(tracepoint->name, "sched_process_exec") == 0)
+        execTracepoint = tracepoint;
+    else if (strcmp(tracepoint->name, "task_rename") == 0)
+        renameTracepoint = tracepoint;
+}
+
+int startShadow(void)
+{
+    /**
+     * Probes go in first, then the tree is seeded from one walk under shadowLock,
+     * so every fork or exit is either seen by the walk or applied after it
+     */
+    struct task_struct *task;
+    char comm[TASK_COMM_LEN];
+    int i;
+
+    for_each_kernel_tracepoint(lookupTracepoint, NULL);
+    if (forkTracepoint == NULL || exitTracepoint == NULL || execTracepoint == NULL || renameTracepoint == NULL)
+        return -ENOENT;
+    if (initTree(&shadowTree, maxTasks) != 0)
+        return -ENOMEM;
+
+    if (tracepoint_probe_register(forkTracepoint, (void *)probeFork, NULL) != 0)
+        goto fail;
+    if (tracepoint_probe_register(exitTracepoint, (void *)probeExit, NULL) != 0)
+        goto failFork;
+    if (tracepoint_probe_register(execTracepoint, (void *)probeExec, NULL) != 0)
+        goto failExit;
+    if (tracepoint_probe_register(renameTracepoint, (void *)probeRename, NULL) != 0)
+        goto failExec;
+
+    lockShadow();
+    rcu_read_lock();
+    for_each_process(task)
+    {
+        if (atomic_read(&task->signal->live) == 0 || findTask(&shadowTree, task->pid) != -1)
+            continue;
+        strscpy_pad(comm, task->comm, TASK_COMM_LEN); // under shadowLock, so no task_lock
+        if (insertTask(&shadowTree, task->pid, task_tgid_nr(rcu_dereference(task->real_parent)), comm) == -1)
+            shadowBroken = true;
+    }
+    rcu_read_unlock();
+
+    // Processes forked before their parent was seeded are linked now too
+    for (i = 0; i < shadowTree.taskCount; i++)
+    {
+        struct task_record *record = &shadowTree.tasks[i];
+        if (record->pid != 0 && record->parent == -1 && record->ppid != record->pid)
+            linkTask(&shadowTree, i, findTask(&shadowTree, record->ppid));
+    }
+    shadowActive = true;
+    spin_unlock(&shadowLock);
+    return 0;
+
+failExec:
+    tracepoint_probe_unregister(execTracepoint, (void *)probeExec, NULL);
+failExit:
+    tracepoint_probe_unregister(exitTracepoint, (void *)probeExit, NULL);
+failFork:
+    tracepoint_probe_unregister(forkTracepoint, (void *)probeFork, NULL);
+fail:
+    tracepoint_synchronize_unregister();
+    freeTree(&shadowTree);
+    return -EINVAL;
+}
+
+void stopShadow(void)
+{
+    if (!shadowActive)
+        return;
+    tracepoint_probe_unregister(renameTracepoint, (void *)probeRename, NULL);
+    tracepoint_probe_unregister(execTracepoint, (void *)probeExec, NULL);
+    tracepoint_probe_unregister(exitTracepoint, (void *)probeExit, NULL);
+    tracepoint_probe_unregister(forkTracepoint, (void *)probeFork, NULL);
+    tracepoint_synchronize_unregister(); // no probe is still running on another CPU
+    shadowActive = false;
+    freeTree(&shadowTree);
+}
+
+static bool matchTask(struct traversal *traversal, int i)
+{
+    /**
+     * Name first from the copy, uid and state only when asked, they need the live task
+     */
+    struct traversal_filter *filter = &traversal->filter;
+    struct task_record *record = &traversal->tree.tasks[i];
+    struct task_struct *task;
+    bool match = true;
+
+    if (filter->comm[0] == '^' && strncmp(record->comm, filter->comm + 1, strlen(filter->comm + 1)) != 0)
+        return false;
+    if (filter->comm[0] != 0 && filter->comm[0] != '^' && strstr(record->comm, filter->comm) == NULL)
+        return false;
+    if (filter->uid == -1 && filter->states[0] == 0)
+        return true;
+
+    rcu_read_lock();
+    task = pid_task(find_pid_ns(record->pid, &init_pid_ns), PIDTYPE_PID);
+    if (task == NULL)
+        match = false; // exited since the snapshot
+    else if (filter->uid != -1 && from_kuid(&init_user_ns, task_uid(task)) != filter->uid)
+        match = false;
+    else if (filter->states[0] != 0 && strchr(filter->states, task_index_to_char(task_state_index(task))) == NULL)
+        match = false;
+    rcu_read_unlock();
+    return match;
+}
+
+bool visitTask(struct traversal *traversal, int i, int depth)
+{
+    /**
+     * Appends i to order and tells the walk whether to go below it,
+     * not past maxDepth nor under a rejected process when pruning
+     */
+    struct traversal_filter *filter = &traversal->filter;
+    bool match = matchTask(traversal, i);
+    traversal->order[traversal->orderCount++] = i;
+    traversal->shown[i] = match;
+    if (filter->maxDepth >= 0 && depth >= filter->maxDepth)
+        return false;
+    return match || !filter->prune;
+}
+
+int initQueue(struct bfs_queue *queue, int capacity)
+{
+    queue->depth = kvmalloc_array(capacity, sizeof(int), GFP_KERNEL);
+    if (queue->depth == NULL)
+        return -ENOMEM;
+    if (kfifo_alloc(&queue->fifo, max(capacity, 2), GFP_KERNEL) != 0) // kfifo needs two slots
+    {
+        kvfree(queue->depth);
+        queue->depth = NULL;
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+void freeQueue(struct bfs_queue *queue)
+{
+    kfifo_free(&queue->fifo);
+    kvfree(queue->depth);
+    queue->depth = NULL;
+}
+
+int BFS(struct traversal *traversal, int root, struct bfs_queue *queue)
+{
+    /**
+     * Level order with a kfifo of task indexes, fills order
+     * queue holds at least taskCount entries and is empty again when the walk ends
+     */
+    struct task_record *tasks = traversal->tree.tasks;
+    int *depth = queue->depth, i, child;
+
+    depth[root] = 0;
+    kfifo_put(&queue->fifo, root);
+    while (kfifo_get(&queue->fifo, &i))
+    {
+        if (!visitTask(traversal, i, depth[i]))
+            continue;
+        for (child = tasks[i].firstChild; child != -1; child = tasks[child].nextSibling)
+        {
+            depth[child] = depth[i] + 1;
+            kfifo_put(&queue->fifo, child);
+        }
+        if (kfifo_len(&queue->fifo) > traversal->timing.peakQueue)
+            traversal->timing.peakQueue = kfifo_len(&queue->fifo);
+    }
+    return 0;
+}
+
+int DFS(struct traversal *traversal, int root)
+{
+    /**
+     * Preorder walk without recursion or a stack, going down firstChild, across nextSibling
+     * and back up parent, so any depth runs in constant kernel stack
+     */
+    struct task_record *tasks = traversal->tree.tasks;
+    int i = root, depth = 0;
+    bool descend = visitTask(traversal, i, depth);
+    while (1)
+    {
+        if (descend && tasks[i].firstChild != -1)
+        {
+            i = tasks[i].firstChild;
+            descend = visitTask(traversal, i, ++depth);
+            if (depth > traversal->timing.peakDepth)
+                traversal->timing.peakDepth = depth;
+            continue;
+        }
+
+        // Leaf or pruned, climb until a process has a next sibling
+        while (i != root && tasks[i].nextSibling == -1)
+        {
+            i = tasks[i].parent;
+            depth--;
+        }
+        if (i == root)
+            break;
+        i = tasks[i].nextSibling;
+        descend = visitTask(traversal, i, depth);
+    }
+    return 0;
+}
+
+int runTraversal(struct traversal *traversal)
+{
+    /**
+     * Fills traversal->order from traversal->pid, from the shadow tree when there is one
+     * Filters cut the walk, the lines and usage, but not the copy: the whole tree is copied first,
+     * so a depth=1 or pruned request still costs one pass over every process
+     * Returns -ESRCH for an unknown PID, -EINVAL for an unknown mode
+     */
+    int root, err;
+    if (strcmp(traversal->mode, "-v") == 0)
+        return runVerify(traversal);
+    if (strcmp(traversal->mode, "-t") == 0)
+        return runTiming(traversal);
+    if (strcmp(traversal->mode, "-b") != 0 && strcmp(traversal->mode, "-d") != 0 && strcmp(traversal->mode, "-a") != 0)
+        return -EINVAL;
+    err = copyShadow(&traversal->tree);
+    if (err == -EAGAIN)
+        err = takeSnapshot(&traversal->tree);
+    if (err != 0)
+        return err;
+
+    root = findTask(&traversal->tree, traversal->pid);
+    if (root == -1)
+        return -ESRCH;
+    traversal->order = kvmalloc_array(traversal->tree.taskCount + 1, sizeof(int), GFP_KERNEL);
+    traversal->shown = kvmalloc_array(traversal->tree.taskCount, sizeof(bool), GFP_KERNEL);
+    if (traversal->order == NULL || traversal->shown == NULL)
+        return -ENOMEM;
+
+    if (strcmp(traversal->mode, "-b") == 0)
+    {
+        struct bfs_queue queue;
+        err = initQueue(&queue, traversal->tree.taskCount);
+        if (err == 0)
+        {
+            err = BFS(traversal, root, &queue);
+            freeQueue(&queue);
+        }
+    }
+    else
+        err = DFS(traversal, root);
+    if (err != 0)
+        return err;
+    if (strcmp(traversal->mode, "-a") == 0)
+        err = runUsage(traversal);
+    else
+        keepShown(traversal);
+    if (err != 0)
+        return err;
+    if (traversal->filter.threads && (err = addThreads(traversal)) != 0)
+        return err;
+    if (traversal->tree.missedCount > 0)
+        traversal->order[traversal->orderCount++] = -1;
+    return 0;
+}
+
+void keepShown(struct traversal *traversal)
+{
+    /**
+     * Drops the processes the walk only went through, keeping the order of the rest
+     */
+    int k, count = 0;
+    for (k = 0; k < traversal->orderCount; k++)
+        if (traversal->shown[traversal->order[k]])
+            traversal->order[count++] = traversal->order[k];
+    traversal->orderCount = count;
+}
+
+int addThreads(struct traversal *traversal)
+{
+    /**
+     * Lists the threads of every shown process right after it, the leader is the process itself
+     * Threads started between counting and listing are left out
+     */
+    struct task_struct *task, *thread;
+    int *order, k, i, count = 0, limit = 0;
+
+    rcu_read_lock();
+    for (k = 0; k < traversal->orderCount; k++)
+    {
+        task = pid_task(find_pid_ns(traversal->tree.tasks[traversal->order[k]].pid, &init_pid_ns), PIDTYPE_PID);
+        if (task != NULL)
+            limit += get_nr_threads(task) - 1;
+    }
+    rcu_read_unlock();
+
+    order = kvmalloc_array(traversal->orderCount + limit + 1, sizeof(int), GFP_KERNEL);
+    traversal->threadRecords = kvmalloc_array(max(limit, 1), sizeof(struct thread_record), GFP_KERNEL);
+    if (order == NULL || traversal->threadRecords == NULL)
+    {
+        kvfree(order);
+        return -ENOMEM;
+    }
+
+    for (k = 0; k < traversal->orderCount; k++)
+    {
+        i = traversal->order[k];
+        order[count++] = i;
+        rcu_read_lock();
+        task = pid_task(find_pid_ns(traversal->tree.tasks[i].pid, &init_pid_ns), PIDTYPE_PID);
+        if (task != NULL)
+        {
+            for_each_thread(task, thread)
             {
-                printk(KERN_INFO "It is empty!\n");
+                if (thread == task)
+                    continue;
+                if (traversal->threadCount == limit)
+                    break;
+                traversal->threadRecords[traversal->threadCount].tid = task_pid_nr(thread);
+                get_task_comm(traversal->threadRecords[traversal->threadCount].comm, thread);
+                order[count++] = -2 - traversal->threadCount++;
             }
         }
+        rcu_read_unlock();
+    }
+
+    kvfree(traversal->order);
+    traversal->order = order;
+    traversal->orderCount = count;
+    return 0;
+}
+
+static void collectUsage(pid_t pid, struct task_usage *usage)
+{
+    /**
+     * Reads one process, a process that exited since the snapshot keeps state X and no usage
+     * CPU time is the sum over its threads plus what its exited threads left in signal
+     */
+    struct task_struct *task, *thread;
+    usage->state = 'X';
+    rcu_read_lock();
+    task = pid_task(find_pid_ns(pid, &init_pid_ns), PIDTYPE_PID); // tree pids are global
+    if (task != NULL)
+    {
+        usage->state = task_index_to_char(task_state_index(task));
+        usage->threads = get_nr_threads(task);
+        usage->utime = task->signal->utime;
+        usage->stime = task->signal->stime;
+        for_each_thread(task, thread)
+        {
+            usage->utime += thread->utime;
+            usage->stime += thread->stime;
+        }
+        task_lock(task); // keeps task->mm from going away
+        if (task->mm != NULL)
+            usage->rss = get_mm_rss(task->mm) << (PAGE_SHIFT - 10);
+        task_unlock(task);
+    }
+    rcu_read_unlock();
+}
 
-        // BFS(nextFrontier);
-    } 
+static int compareUsage(const void *a, const void *b)
+{
+    const struct usage_key *x = a, *y = b;
+    return x->key < y->key ? 1 : x->key > y->key ? -1 : 0; // heaviest first
 }
-**/
+
+int runUsage(struct traversal *traversal)
+{
+    /**
+     * Reads every process of the DFS order, then sums subtrees in one pass over it backwards,
+     * where every child comes before its parent
+     * Sums cover every walked process, also those the filter hides, but stop at maxDepth and pruned subtrees
+     * top keeps the heaviest shown processes by subtree cpu, rss or threads
+     */
+    struct task_record *tasks = traversal->tree.tasks;
+    struct task_usage *usage;
+    struct usage_key *keys;
+    int k, i, parent, count = traversal->orderCount;
+
+    usage = traversal->usage = kvcalloc(traversal->tree.taskCount, sizeof(struct task_usage), GFP_KERNEL);
+    if (usage == NULL)
+        return -ENOMEM;
+    for (k = 0; k < count; k++)
+    {
+        i = traversal->order[k];
+        collectUsage(tasks[i].pid, &usage[i]);
+        usage[i].subtreeProcesses = 1;
+        usage[i].subtreeThreads = usage[i].threads;
+        usage[i].subtreeRss = usage[i].rss;
+        usage[i].subtreeUtime = usage[i].utime;
+        usage[i].subtreeStime = usage[i].stime;
+        cond_resched(); // a subtree can be tens of thousands of processes
+    }
+    for (k = count - 1; k > 0; k--)
+    {
+        i = traversal->order[k];
+        parent = tasks[i].parent;
+        usage[parent].subtreeProcesses += usage[i].subtreeProcesses;
+        usage[parent].subtreeThreads += usage[i].subtreeThreads;
+        usage[parent].subtreeRss += usage[i].subtreeRss;
+        usage[parent].subtreeUtime += usage[i].subtreeUtime;
+        usage[parent].subtreeStime += usage[i].subtreeStime;
+    }
+
+    keepShown(traversal);
+    count = traversal->orderCount;
+    if (traversal->top == 0)
+        return 0;
+    keys = kvmalloc_array(count, sizeof(struct usage_key), GFP_KERNEL);
+    if (keys == NULL)
+        return -ENOMEM;
+    for (k = 0; k < count; k++)
+    {
+        i = traversal->order[k];
+        keys[k].index = i;
+        if (strcmp(traversal->sortKey, "rss") == 0)
+            keys[k].key = usage[i].subtreeRss;
+        else if (strcmp(traversal->sortKey, "threads") == 0)
+            keys[k].key = usage[i].subtreeThreads;
+        else
+            keys[k].key = usage[i].subtreeUtime + usage[i].subtreeStime;
+    }
+    sort(keys, count, sizeof(struct usage_key), compareUsage, NULL);
+    if (traversal->top < count)
+        count = traversal->top;
+    for (k = 0; k < count; k++)
+        traversal->order[k] = keys[k].index;
+    traversal->orderCount = count;
+    kvfree(keys);
+    return 0;
+}
+
+int runTiming(struct traversal *traversal)
+{
+    /**
+     * Times taking the tree once, then top rounds (1 to MAX_ROUNDS) of BFS and of DFS from traversal->pid
+     * Each round walks the same copy with the BFS queue allocated up front, so only the walk itself is measured
+     */
+    struct traversal_timing *timing = &traversal->timing;
+    struct bfs_queue queue;
+    int root, round, err, walkRounds = clamp(traversal->top, 1, MAX_ROUNDS);
+    u64 start = ktime_get_ns();
+
+    err = copyShadow(&traversal->tree);
+    timing->fromShadow = err != -EAGAIN;
+    if (err == -EAGAIN)
+        err = takeSnapshot(&traversal->tree);
+    timing->snapshotNs = ktime_get_ns() - start;
+    if (err != 0)
+        return err;
+
+    root = findTask(&traversal->tree, traversal->pid);
+    if (root == -1)
+        return -ESRCH;
+    traversal->order = kvmalloc_array(max(traversal->tree.taskCount + 1, 3), sizeof(int), GFP_KERNEL);
+    traversal->shown = kvmalloc_array(traversal->tree.taskCount, sizeof(bool), GFP_KERNEL);
+    if (traversal->order == NULL || traversal->shown == NULL)
+        return -ENOMEM;
+    if (initQueue(&queue, traversal->tree.taskCount) != 0)
+        return -ENOMEM;
+
+    for (round = 0; round < walkRounds; round++)
+    {
+        traversal->orderCount = 0;
+        start = ktime_get_ns();
+        BFS(traversal, root, &queue);
+        timing->bfsNs += ktime_get_ns() - start;
+        cond_resched();
+    }
+    freeQueue(&queue);
+    timing->bfsCount = traversal->orderCount;
+    for (round = 0; round < walkRounds; round++)
+    {
+        traversal->orderCount = 0;
+        start = ktime_get_ns();
+        DFS(traversal, root);
+        timing->dfsNs += ktime_get_ns() - start;
+        cond_resched();
+    }
+    timing->dfsCount = traversal->orderCount;
+
+    traversal->top = walkRounds;
+    traversal->order[0] = 0;
+    traversal->order[1] = 1;
+    traversal->order[2] = 2;
+    traversal->orderCount = 3;
+    return 0;
+}
+
+static pid_t parentPid(struct process_tree *tree, int i)
+{
+    return tree->tasks[i].parent == -1 ? 0 : tree->tasks[tree->tasks[i].parent].pid;
+}
+
+int runVerify(struct traversal *traversal)
+{
+    /**
+     * Walks the task list without shadowLock, then copies the shadow tree if no probe changed it meanwhile,
+     * and lists every process whose parent or name differ and every one only the shadow tree has
+     * A walk that raced a change is taken again, -EBUSY after VERIFY_ATTEMPTS of them
+     * /proc/pstraverse only runs it for CAP_SYS_ADMIN
+     */
+    struct process_tree *fresh = &traversal->tree, *copy = &traversal->shadowCopy;
+    int i, s, attempt, count = 0;
+    u64 generation;
+    if (!shadowActive)
+        return -EOPNOTSUPP;
+    if (initTree(fresh, maxTasks) != 0 || initTree(copy, maxTasks) != 0)
+        return -ENOMEM;
+    traversal->order = kvmalloc_array(2 * maxTasks + 1, sizeof(int), GFP_KERNEL);
+    if (traversal->order == NULL)
+        return -ENOMEM;
+
+    for (attempt = 1;; attempt++)
+    {
+        lockShadow();
+        generation = shadowGeneration;
+        spin_unlock(&shadowLock);
+        fillSnapshot(fresh, true);
+        lockShadow();
+        if (shadowGeneration == generation)
+            break; // still holding shadowLock
+        spin_unlock(&shadowLock);
+        freeTree(fresh);
+        if (attempt == VERIFY_ATTEMPTS)
+            return -EBUSY;
+        if (initTree(fresh, maxTasks) != 0)
+            return -ENOMEM;
+        cond_resched();
+    }
+    memcpy(copy->tasks, shadowTree.tasks, shadowTree.taskCount * sizeof(struct task_record));
+    memcpy(copy->buckets, shadowTree.buckets, shadowTree.bucketCount * sizeof(int));
+    copy->taskCount = shadowTree.taskCount;
+    copy->liveCount = shadowTree.liveCount;
+    copy->missedCount = shadowBroken ? shadowTree.missedCount + 1 : 0;
+    spin_unlock(&shadowLock);
+
+    for (i = 0; i < fresh->taskCount; i++)
+    {
+        s = findTask(copy, fresh->tasks[i].pid);
+        if (s == -1 || parentPid(copy, s) != parentPid(fresh, i) || strcmp(copy->tasks[s].comm, fresh->tasks[i].comm) != 0)
+            traversal->order[count++] = i;
+    }
+    for (s = 0; s < copy->taskCount; s++)
+        if (copy->tasks[s].pid != 0 && findTask(fresh, copy->tasks[s].pid) == -1)
+            traversal->order[count++] = -2 - s;
+    traversal->mismatchCount = count;
+    traversal->order[count++] = -1;
+    traversal->orderCount = count;
+    return 0;
+}
+
+void freeTraversal(struct traversal *traversal)
+{
+    freeTree(&traversal->tree);
+    freeTree(&traversal->shadowCopy);
+    kvfree(traversal->usage);
+    traversal->usage = NULL;
+    kvfree(traversal->threadRecords);
+    traversal->threadRecords = NULL;
+    traversal->threadCount = 0;
+    kvfree(traversal->shown);
+    traversal->shown = NULL;
+    kvfree(traversal->order);
+    traversal->order = NULL;
+    traversal->orderCount = 0;
+}
+
+/**
+ * /proc/pstraverse, write "PID -b" or "PID -d" then read the traversal one line per process
+ * "PID -a [N [cpu|rss|threads]]" adds resource usage, with N the heaviest subtrees first
+ * Options after the mode filter the walk: depth=N comm=NAME or comm=^PREFIX uid=N state=RD threads=1 prune=1,
+ * the process table is still copied whole before it
+ * "0 -v" reads the differences between the shadow tree and the task list instead, it needs CAP_SYS_ADMIN
+ * "PID -t [N]" reads how long the snapshot and N rounds of BFS and DFS took, N up to 1000
+ * Each open file has its own traversal, taken on the first read after a write
+ * and streamed a page at a time by seq_file, every write reads from the start again
+ * Only CAP_SYS_ADMIN opens it for writing, other users fall back to the shell's /proc backend
+ */
+static void *pstraverse_start(struct seq_file *seq, loff_t *pos)
+{
+    struct traversal *traversal = seq->private;
+    if (traversal->pid < 0)
+        return NULL;
+    if (traversal->order == NULL)
+    {
+        int err = runTraversal(traversal);
+        if (err != 0)
+        {
+            freeTraversal(traversal);
+            traversal->pid = -1; // reported once, the next write asks again
+            return ERR_PTR(err);
+        }
+    }
+    return *pos < traversal->orderCount ? &traversal->order[*pos] : NULL;
+}
+
+static void *pstraverse_next(struct seq_file *seq, void *v, loff_t *pos)
+{
+    struct traversal *traversal = seq->private;
+    ++*pos;
+    return *pos < traversal->orderCount ? &traversal->order[*pos] : NULL;
+}
+
+static void pstraverse_stop(struct seq_file *seq, void *v)
+{
+}
+
+void formatLine(struct traversal *traversal, int i, char *line)
+{
+    /**
+     * The line for order entry i, shared by dmesg and /proc/pstraverse
+     */
+    struct process_tree *tree = &traversal->tree, *copy = &traversal->shadowCopy;
+    struct traversal_timing *timing = &traversal->timing;
+    struct task_usage *usage;
+    int s;
+
+    if (strcmp(traversal->mode, "-t") == 0)
+    {
+        u64 ns = i == 1 ? timing->bfsNs : timing->dfsNs;
+        int count = i == 1 ? timing->bfsCount : timing->dfsCount;
+        if (i == 0)
+            snprintf(line, LINE_SIZE, "snapshot: %d processes from the %s in %llu ns\n", tree->liveCount,
+                     timing->fromShadow ? "shadow tree" : "task list", timing->snapshotNs);
+        else
+            snprintf(line, LINE_SIZE, "%s: %d processes, %d rounds, %llu ns per round, %llu processes/s, peak %s %d\n",
+                     i == 1 ? "BFS" : "DFS", count, traversal->top, div_u64(ns, traversal->top),
+                     div64_u64((u64)count * NSEC_PER_SEC, max_t(u64, div_u64(ns, traversal->top), 1)), i == 1 ? "queue" : "depth",
+                     i == 1 ? timing->peakQueue : timing->peakDepth);
+        return;
+    }
+
+    if (strcmp(traversal->mode, "-v") == 0)
+    {
+        if (i == -1)
+            snprintf(line, LINE_SIZE, "verify: %d processes, %d in the shadow tree, %d mismatches%s\n", tree->liveCount,
+                     copy->liveCount, traversal->mismatchCount, copy->missedCount > 0 ? ", shadow tree overflowed" : "");
+        else if (i <= -2)
+            snprintf(line, LINE_SIZE, "PID: %d, Name: %s, exited but still in the shadow tree\n", copy->tasks[-2 - i].pid,
+                     copy->tasks[-2 - i].comm);
+        else if ((s = findTask(copy, tree->tasks[i].pid)) == -1)
+            snprintf(line, LINE_SIZE, "PID: %d, Name: %s, missing from the shadow tree\n", tree->tasks[i].pid, tree->tasks[i].comm);
+        else
+            snprintf(line, LINE_SIZE, "PID: %d, Name: %s, parent %d, shadow tree has %s under %d\n", tree->tasks[i].pid,
+                     tree->tasks[i].comm, parentPid(tree, i), copy->tasks[s].comm, parentPid(copy, s));
+        return;
+    }
+
+    if (i == -1)
+        snprintf(line, LINE_SIZE, "%d processes past maxTasks=%d were not visited!\n", tree->missedCount, maxTasks);
+    else if (i <= -2)
+        snprintf(line, LINE_SIZE, "    TID: %d, Name: %s\n", traversal->threadRecords[-2 - i].tid, traversal->threadRecords[-2 - i].comm);
+    else if (traversal->usage == NULL)
+        snprintf(line, LINE_SIZE, "PID: %d, Name: %s\n", tree->tasks[i].pid, tree->tasks[i].comm);
+    else
+    {
+        usage = &traversal->usage[i];
+        snprintf(line, LINE_SIZE, "PID: %d, Name: %s, State: %c, Threads: %d, RSS: %lu kB, User: %llu ms, System: %llu ms, "
+                 "Subtree: %d processes, %d threads, %lu kB, %llu ms user, %llu ms system\n",
+                 tree->tasks[i].pid, tree->tasks[i].comm, usage->state, usage->threads, usage->rss,
+                 usage->utime / NSEC_PER_MSEC, usage->stime / NSEC_PER_MSEC, usage->subtreeProcesses, usage->subtreeThreads,
+                 usage->subtreeRss, usage->subtreeUtime / NSEC_PER_MSEC, usage->subtreeStime / NSEC_PER_MSEC);
+    }
+}
+
+static int pstraverse_show(struct seq_file *seq, void *v)
+{
+    char line[LINE_SIZE];
+    formatLine(seq->private, *(int *)v, line);
+    seq_puts(seq, line);
+    return 0;
+}
+
+const struct seq_operations pstraverse_seq_ops = {
+    .start = pstraverse_start,
+    .next = pstraverse_next,
+    .stop = pstraverse_stop,
+    .show = pstraverse_show,
+};
+
+static int pstraverse_open(struct inode *inode, struct file *file)
+{
+    struct traversal *traversal;
+    if ((file->f_mode & FMODE_WRITE) && !capable(CAP_SYS_ADMIN)) // a request allocates maxTasks-sized copies
+        return -EPERM;
+    traversal = __seq_open_private(file, &pstraverse_seq_ops, sizeof(struct traversal));
+    if (traversal == NULL)
+        return -ENOMEM;
+    traversal->pid = -1;
+    return 0;
+}
+
+static ssize_t pstraverse_write(struct file *file, const char __user *buffer, size_t count, loff_t *ppos)
+{
+    struct seq_file *seq = file->private_data;
+    struct traversal *traversal = seq->private;
+    struct traversal_filter filter = {.maxDepth = -1, .uid = -1};
+    char request[REQUEST_SIZE], mode[4], sortKey[8] = "cpu";
+    char *cursor = request, *token;
+    int pid, top = 0, fields = 0;
+
+    if (count >= REQUEST_SIZE)
+        return -EINVAL;
+    if (copy_from_user(request, buffer, count))
+        return -EFAULT;
+    request[count] = 0;
+    while ((token = strsep(&cursor, " \t\n")) != NULL)
+    {
+        int err = 0;
+        if (*token == 0)
+            continue;
+        if (fields == 0)
+            err = kstrtoint(token, 10, &pid);
+        else if (fields == 1)
+            err = strscpy(mode, token, sizeof(mode)) < 0;
+        else if (strncmp(token, "depth=", 6) == 0)
+            err = kstrtoint(token + 6, 10, &filter.maxDepth);
+        else if (strncmp(token, "comm=", 5) == 0)
+            err = strscpy(filter.comm, token + 5, sizeof(filter.comm)) < 0;
+        else if (strncmp(token, "uid=", 4) == 0)
+            err = kstrtoint(token + 4, 10, &filter.uid);
+        else if (strncmp(token, "state=", 6) == 0)
+            err = strscpy(filter.states, token + 6, sizeof(filter.states)) < 0;
+        else if (strncmp(token, "threads=", 8) == 0)
+            err = kstrtobool(token + 8, &filter.threads);
+        else if (strncmp(token, "prune=", 6) == 0)
+            err = kstrtobool(token + 6, &filter.prune);
+        else if (isdigit(*token))
+            err = kstrtoint(token, 10, &top);
+        else
+            err = strscpy(sortKey, token, sizeof(sortKey)) < 0;
+        if (err != 0)
+            return -EINVAL;
+        fields++;
+    }
+    if (fields < 2 || pid < 0 || top < 0)
+        return -EINVAL;
+    if (strcmp(mode, "-b") != 0 && strcmp(mode, "-d") != 0 && strcmp(mode, "-a") != 0 && strcmp(mode, "-v") != 0 &&
+        strcmp(mode, "-t") != 0)
+        return -EINVAL;
+    if (strcmp(sortKey, "cpu") != 0 && strcmp(sortKey, "rss") != 0 && strcmp(sortKey, "threads") != 0)
+        return -EINVAL;
+    if (strcmp(mode, "-v") == 0 && !file_ns_capable(file, &init_user_ns, CAP_SYS_ADMIN)) // checks who opened the file
+        return -EPERM;
+
+    mutex_lock(&seq->lock); // seq_read holds it while it walks order
+    freeTraversal(traversal);
+    traversal->pid = pid;
+    traversal->top = top;
+    traversal->filter = filter;
+    traversal->timing = (struct traversal_timing){0};
+    strscpy(traversal->mode, mode, sizeof(traversal->mode));
+    strscpy(traversal->sortKey, sortKey, sizeof(traversal->sortKey));
+    seq->index = 0; // the next read starts from the first line again
+    seq->count = 0;
+    seq->from = 0;
+    seq->read_pos = 0;
+    *ppos = 0;
+    mutex_unlock(&seq->lock);
+    return count;
+}
+
+static int pstraverse_release(struct inode *inode, struct file *file)
+{
+    struct seq_file *seq = file->private_data;
+    freeTraversal(seq->private);
+    return seq_release_private(inode, file);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+const struct proc_ops pstraverse_proc_ops = {
+    .proc_open = pstraverse_open,
+    .proc_read = seq_read,
+    .proc_write = pstraverse_write,
+    .proc_lseek = seq_lseek,
+    .proc_release = pstraverse_release,
+};
+#else
+const struct file_operations pstraverse_proc_ops = {
+    .owner = THIS_MODULE,
+    .open = pstraverse_open,
+    .read = seq_read,
+    .write = pstraverse_write,
+    .llseek = seq_lseek,
+    .release = pstraverse_release,
+};
+#endif
 
 module_init(my_module_init);
 module_exit(my_module_exit);
@@ -9,6 +9,8 @@
  * 
  */
 
+#define _GNU_SOURCE // pipe2, splice, tee
+
 #include <unistd.h>
 #include <sys/wait.h>
 #include <stdio.h>
@@ -20,9 +22,71 @@
 
 #include <time.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <spawn.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <regex.h>
+#include <limits.h>
+#include <sys/inotify.h>
+#include <sys/prctl.h>
+#include <ctype.h>
+#include <sys/sendfile.h>
+#include <pwd.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 const char *sysname = "shellfyre";
 char *directory_history = "/home/vedat/dirhist.txt";
 char *records = "/home/vedat/hotandcoldrecord.txt";
+char *command_history; // cmdhist.txt in the home directory, set in main
+char *pstraverse_file = "/proc/pstraverse"; // served by my_module.ko
+
+/**
+ * Visits not yet appended to directory_history, as rank|time|path records
+ */
+#define DIR_RING_SIZE 32
+
+#define SCRIPT_BLOCK_SIZE 65536 // read size for scripts and piped input
+char *dir_ring[DIR_RING_SIZE];
+int dir_ring_start = 0, dir_ring_count = 0;
+
+/**
+ * Directory database for cdh, one entry per directory scored by frequency and recency
+ * directory_history is a log of visits that is folded into one line per directory
+ * once it holds twice as many lines as directories
+ */
+#define DIR_DB_BUCKETS 1024
+#define DIR_DB_MAX_RANK 9000 // ranks are aged once their sum passes this
+
+struct dir_entry
+{
+	char *path;
+	double rank; // visits, aged on compaction
+	time_t time; // last visit
+	int next;	 // next entry in the same bucket, -1 at the end
+};
+
+struct dir_match
+{
+	const char *path;
+	double score;
+};
+
+struct dir_db_t
+{
+	struct dir_entry *entries;
+	int count, capacity;
+	int *buckets;
+	int log_lines; // lines in directory_history
+} dir_db;
 
 enum return_codes
 {
@@ -35,13 +99,496 @@ struct command_t
 {
 	char *name;
 	bool background;
-	bool auto_complete;
 	int arg_count;
+	int arg_capacity;
 	char **args;
-	char *redirects[3];		// in/out redirection
+	char *redirects[5];		// <, >, >>, 2>, &> redirection
 	struct command_t *next; // for piping
 };
 
+/**
+ * Bump allocator for everything parse_command builds
+ * Reset once the command is processed, chunks are kept for the next line
+ */
+#define ARENA_CHUNK_SIZE 8192
+
+struct arena_chunk
+{
+	struct arena_chunk *next;
+	size_t size;
+	size_t used;
+	char data[];
+};
+
+struct arena
+{
+	struct arena_chunk *head;
+	struct arena_chunk *current;
+	size_t allocations; // malloc calls made for chunks
+};
+
+struct arena parse_arena;
+
+#define REDIRECT_COUNT 5
+
+/**
+ * Tokens of a command line, words are views into the line
+ */
+enum token_types
+{
+	TOKEN_END = 0,
+	TOKEN_WORD,
+	TOKEN_PIPE,		  // |
+	TOKEN_BACKGROUND, // &
+	TOKEN_REDIRECT,	  // <, >, >>, 2>, &>
+};
+
+struct token_t
+{
+	int type;
+	int redirect_index; // slot in command_t::redirects
+	char *start;		// not NUL terminated
+	size_t len;
+};
+
+struct lexer_t
+{
+	char *pos;
+};
+
+/**
+ * Line editor, the terminal is switched to raw mode once and stays there
+ * until a foreground job needs it cooked
+ */
+#define LINE_SIZE 4096
+
+struct line_editor_t
+{
+	char buf[LINE_SIZE];
+	int len;
+	int pos;		   // cursor offset in buf
+	int segment_start; // start of the current physical line of a multi-line command
+	char prompt[2048];
+	int prompt_len;
+	int cols;
+	int cursor_row;		// row of the cursor below the first prompt row
+	char pending[LINE_SIZE]; // bytes read past the end of the last line
+	int pending_len;
+	char line_prompt[2048];		// prompt of the current physical line, editor.prompt changes while searching
+	int history_pos;			// entry shown by up/down, -1 when not navigating
+	char saved_line[LINE_SIZE]; // what was typed before navigating or searching
+	int saved_len;
+	bool searching; // inside Ctrl+R
+	char query[256];
+	int query_len;
+	int match; // entry found by the search, -1 if none
+};
+
+struct line_editor_t editor;
+struct termios cooked_termios, raw_termios;
+bool terminal_is_raw = false;
+bool terminal_saved = false;
+
+/**
+ * Command history, command_history is mmap'd on first use and lines added
+ * since then are kept in a ring until the file is mapped again
+ */
+#define HISTORY_RING_SIZE 256
+
+struct history_entry
+{
+	size_t offset; // in history.map
+	int len;
+	unsigned long long bigrams; // bloom mask of the character pairs in the entry
+};
+
+struct history_t
+{
+	int fd;
+	char *map;
+	size_t map_length;	// bytes mapped
+	size_t indexed;		// bytes of map split into entries, always ends at a newline
+	struct history_entry *entries;
+	int count, capacity;
+	char *ring[HISTORY_RING_SIZE];
+	unsigned long long ring_bigrams[HISTORY_RING_SIZE];
+	bool ring_saved[HISTORY_RING_SIZE]; // already appended to command_history
+	int ring_count;
+};
+
+struct history_t history = {.fd = -1};
+
+/**
+ * Tab completion, command names live in a prefix trie rebuilt when PATH or one of
+ * its directories changes, directory listings are cached until their mtime moves
+ */
+#define COMPLETION_DIR_CACHE 8
+#define COMPLETION_MAX 4096
+#define COMPLETION_PATH_DIRS 64
+
+struct trie_node
+{
+	struct trie_node *child;   // first child, children are sorted by c
+	struct trie_node *sibling; // next child of the same parent
+	char c;
+	bool terminal; // a name ends here
+};
+
+struct completion_entry
+{
+	char *name;
+	bool is_dir;
+};
+
+struct completion_dir
+{
+	char *path; // NULL for a free slot
+	struct timespec mtime;
+	struct completion_entry *entries; // sorted by name
+	int count;
+	unsigned long used; // completion_clock of the last lookup, the oldest slot is reused
+};
+
+struct arena trie_arena;	   // nodes of command_trie
+struct arena completion_arena; // results of one completion
+struct trie_node *command_trie = NULL;
+char *trie_path_env = NULL; // PATH value the trie was built from
+struct timespec trie_mtimes[COMPLETION_PATH_DIRS];
+struct completion_dir completion_dirs[COMPLETION_DIR_CACHE];
+unsigned long completion_clock = 0;
+
+/**
+ * Command hash table, maps command names to resolved paths like bash's hash
+ */
+#define COMMAND_HASH_SIZE 64
+
+struct hash_entry
+{
+	char *name;
+	char *path;
+	int hits;
+	struct hash_entry *next;
+};
+
+struct hash_entry *command_hash[COMMAND_HASH_SIZE];
+char *hashed_path_env = NULL; // PATH value the table was filled with
+
+/**
+ * Process launch strategies, posix_spawn avoids copying the shell's page tables
+ */
+enum spawn_strategies
+{
+	SPAWN_POSIX = 0,
+	SPAWN_FORK = 1,
+};
+
+int spawn_strategy = SPAWN_POSIX;
+extern char **environ;
+
+/**
+ * Relay stages (cat, tee FILE) of a pipeline are run by the shell with splice()/tee()
+ */
+bool pipeline_zero_copy = false;
+#define RELAY_CHUNK 65536
+
+/**
+ * Commands handled by the shell itself, registered with register_builtin
+ * Looked up by name in an open addressing table, so dispatch does not grow with their number
+ */
+#define BUILTIN_SLOTS 64 // power of two, at most half full
+
+struct command_t;
+typedef int (*builtin_handler)(struct command_t *command);
+
+struct builtin_t
+{
+	const char *name; // NULL for an empty slot
+	builtin_handler handler;
+	int min_args, max_args; // -1 for no upper limit
+	const char *usage;
+};
+
+struct builtin_t builtins[BUILTIN_SLOTS];
+int builtin_count = 0;
+
+/**
+ * Job table, one entry per process group started by the shell
+ * Process fields are updated by the SIGCHLD handler, block SIGCHLD to touch them
+ */
+#define MAX_JOBS 64
+#define MAX_JOB_PROCS 32
+
+struct job_t
+{
+	int id; // 0 marks a free slot
+	pid_t pgid; // 0 until the first process starts, or when not interactive
+	bool background;
+	bool daemon; // runs until the shell exits, wait without a job skips it
+	int proc_count;
+	pid_t pids[MAX_JOB_PROCS];
+	int statuses[MAX_JOB_PROCS];
+	bool stopped[MAX_JOB_PROCS];
+	int live;		// processes not reaped yet
+	int stop_count; // live processes currently stopped
+	char cmdline[256];
+};
+
+struct job_t jobs[MAX_JOBS];
+int last_status = 0; // exit status of the last command, what a script or -c exits with
+bool shell_interactive = false; // we own the terminal and do job control
+sigset_t sigchld_mask;
+const int job_signals[] = {SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU}; // ignored by an interactive shell
+
+/**
+ * Profiler, times the stages of every command while enabled by SHELLFYRE_PROFILE or the
+ * profile builtin, a SHELLFYRE_PROFILE ending in .json names a Chrome trace written at exit
+ */
+#define PROFILE_BUCKETS 512 // 8 per power of two of nanoseconds
+#define PROFILE_MAX_EVENTS 65536
+
+enum profile_stages
+{
+	PROFILE_STARTUP = 0,
+	PROFILE_PROMPT = 1,
+	PROFILE_PARSE = 2,
+	PROFILE_DISPATCH = 3,
+	PROFILE_SPAWN = 4,
+	PROFILE_WAIT = 5,
+	PROFILE_STAGES = 6,
+};
+
+const char *profile_stage_names[PROFILE_STAGES] = {"startup", "prompt", "parse", "dispatch", "spawn", "wait"};
+
+struct profile_event
+{
+	int stage;
+	long long start; // ns since the shell started
+	long long duration;
+	char label[32];
+};
+
+struct profile_t
+{
+	bool enabled;
+	long long epoch;  // shell start, CLOCK_MONOTONIC ns
+	char *trace_file; // written at exit
+	bool summary;	  // printed at exit
+	long long buckets[PROFILE_STAGES][PROFILE_BUCKETS];
+	long long samples[PROFILE_STAGES], total[PROFILE_STAGES], max[PROFILE_STAGES];
+	struct profile_event *events;
+	int event_count;
+	long long dropped; // events past PROFILE_MAX_EVENTS
+} profiler;
+
+/**
+ * Userspace pstraverse backend, the same tree built from /proc/<pid>/stat
+ * Stat files are read by a few threads with openat() relative to proc_fd, opened once
+ * Tree links are indexes into the pid-sorted tasks, -1 for none
+ */
+#define PROC_SCAN_MAX_THREADS 8
+#define PROC_SCAN_CHUNK 64 // stat files a thread claims at a time
+
+struct proc_task
+{
+	pid_t pid, ppid;
+	char comm[16];
+	char state;
+	int threads;
+	long rss_pages;
+	unsigned long long utime, stime, start_time; // clock ticks
+	int parent, first_child, last_child, next_sibling;
+	bool valid; // false once the process is gone before its stat was read
+};
+
+struct proc_scan
+{
+	struct proc_task *tasks;
+	int count;
+	atomic_int next;
+};
+
+/**
+ * What pstraverse shows, sent to the module as depth= comm= uid= state= threads= prune= options
+ */
+struct pstraverse_filter
+{
+	int max_depth;	 // levels below PID, -1 for all
+	char comm[17];	 // substring, or ^prefix
+	int uid;		 // real uid, -1 for all
+	char states[16]; // state letters, like RD
+	bool threads;	 // list the threads of every process
+	bool prune;		 // skip the whole subtree of a rejected process
+};
+
+int proc_fd = -1;
+
+/**
+ * filesearch, directories are read with getdents64() by a pool of threads
+ * Each worker keeps a deque of directories, pops its own newest one and
+ * steals the oldest one of another worker when it runs out
+ */
+#define SEARCH_DENTS_SIZE 65536
+#define SEARCH_OUTPUT_SIZE 65536
+#define SEARCH_MAX_THREADS 64
+#define SEARCH_COPY_CHUNK (1 << 30)
+#define SEARCH_SMALL_FILE 65536 // -c reads files up to this size instead of mapping them
+
+enum search_copy_methods
+{
+	COPY_FILE_RANGE = 0, // stdout is a regular file
+	COPY_SENDFILE = 1,	 // pipes, sockets and terminals
+	COPY_READ_WRITE = 2,
+};
+
+/**
+ * Substring kernels of filesearch -c, picked from the CPU at startup
+ */
+enum content_kernels
+{
+	KERNEL_SCALAR = 0,
+	KERNEL_SSE2 = 1,
+	KERNEL_AVX2 = 2,
+};
+
+const char *content_kernel_names[] = {"scalar", "sse2", "avx2"};
+int content_kernel = KERNEL_SCALAR;
+
+enum search_modes
+{
+	SEARCH_SUBSTRING = 0, // name contains the pattern, like find -name '*pattern*'
+	SEARCH_GLOB = 1,
+	SEARCH_REGEX = 2,
+};
+
+struct search_task
+{
+	char *path; // relative to the current directory, "./a/b"
+	int depth;
+};
+
+struct search_worker
+{
+	pthread_t thread;
+	int id;
+	pthread_mutex_t lock; // guards the deque, taken by thieves too
+	struct search_task *tasks;
+	int head, tail, capacity;
+	char *dents;
+	char *output;
+	int output_len;
+	char *file; // -c, small files are read here
+	struct search_t *search;
+};
+
+struct search_ignore
+{
+	char *pattern;
+	bool dir_only; // written with a trailing slash
+};
+
+struct search_t
+{
+	int mode;
+	const char *pattern;
+	regex_t regex;
+	int max_depth; // -1 for no limit
+	bool open_files;
+	int copy_method; // how -o copies files to stdout, guarded by output_lock
+	const char *content; // -c, searched for inside matching files
+	size_t content_len;
+	struct search_ignore *ignores;
+	int ignore_count;
+	int thread_count;
+	struct search_worker workers[SEARCH_MAX_THREADS];
+	atomic_int pending; // tasks queued or being read
+	atomic_int queued;
+	atomic_int idle;
+	pthread_mutex_t idle_lock;
+	pthread_cond_t idle_cond;
+	pthread_mutex_t output_lock;
+	atomic_long matches;
+	bool live;			   // -L, skip the index
+	const char *index_sub; // searched directory relative to the indexed root
+};
+
+/**
+ * Filename index kept by filesearch -I, file_index holds every name under one
+ * root with trigram postings and file_index.delta logs the changes inotify saw since
+ * Delta records are "+d path" or "+f path" for an addition, "-- path" for a removal
+ * and "?d path" for a directory left unwatched, whose contents queries scan live
+ */
+#define FILE_INDEX_MAGIC 0x31584653
+#define FILE_INDEX_COMPACT 4096 // delta records tolerated before the index is rewritten
+
+struct file_index_header
+{
+	unsigned int magic;
+	unsigned int generation; // must match the first line of the delta log
+	int watcher;			 // pid of the process keeping the index current
+	unsigned int entry_count;
+	unsigned int trigram_count;
+	unsigned int root_len; // root follows the header, "" for /
+	unsigned long long entries_offset, trigrams_offset, postings_offset, paths_offset, size;
+};
+
+struct file_index_entry
+{
+	unsigned int path;	 // offset in the path blob, relative to the root
+	unsigned short name; // offset of the last component in the path
+	unsigned short is_dir;
+};
+
+struct file_index_trigram
+{
+	unsigned int trigram;
+	unsigned int start; // first posting
+	unsigned int count;
+};
+
+struct file_index_builder
+{
+	char *root;
+	int inotify_fd;
+	char **watch_paths; // path of each watch descriptor relative to the root
+	int watch_capacity;
+	char *paths;
+	size_t paths_len, paths_capacity;
+	struct file_index_entry *entries;
+	unsigned int count, capacity;
+	bool ready; // base written, changes go to the delta log
+	char **unwatched; // directories inotify refused while building, logged once the delta log exists
+	int unwatched_count, unwatched_capacity;
+	int delta_fd;
+	int delta_records;
+	unsigned int generation;
+};
+
+/**
+ * Delta log loaded by a query, the last removal and addition of each path are hashed
+ */
+struct index_change
+{
+	char *path;
+	int len;
+	bool removed;
+	bool is_dir;
+	bool unwatched; // a directory the daemon could not watch, listed live by queries
+};
+
+struct index_delta
+{
+	char *text;
+	struct index_change *changes;
+	int count;
+	int *removals; // open addressing table of change indexes, -1 for empty
+	int *additions;
+	int *unwatched;
+	int unwatched_count;
+	int table_size;
+};
+
+char *file_index; // fsindex in the home directory, set in main
+
 /**
  * Prints a command struct
  * @param struct command_t *
@@ -51,9 +598,8 @@ void print_command(struct command_t *command)
 	int i = 0;
 	printf("Command: <%s>\n", command->name);
 	printf("\tIs Background: %s\n", command->background ? "yes" : "no");
-	printf("\tNeeds Auto-complete: %s\n", command->auto_complete ? "yes" : "no");
 	printf("\tRedirects:\n");
-	for (i = 0; i < 3; i++)
+	for (i = 0; i < REDIRECT_COUNT; i++)
 		printf("\t\t%d: %s\n", i, command->redirects[i] ? command->redirects[i] : "N/A");
 	printf("\tArguments (%d):\n", command->arg_count);
 	for (i = 0; i < command->arg_count; ++i)
@@ -65,115 +611,310 @@ void print_command(struct command_t *command)
 	}
 }
 
-/**
- * Release allocated memory of a command
- * @param  command [description]
- * @return         [description]
- */
-int free_command(struct command_t *command)
+void *arena_alloc(struct arena *arena, size_t size)
 {
-	if (command->arg_count)
+	/**
+	 * Returns size bytes, 16 byte aligned, valid until the next arena_reset
+	 */
+	size = (size + 15) & ~(size_t)15;
+	struct arena_chunk *chunk = arena->current;
+	while (chunk != NULL && chunk->used + size > chunk->size)
+		chunk = chunk->next; // chunks kept from earlier lines
+	if (chunk == NULL)
 	{
-		for (int i = 0; i < command->arg_count; ++i)
-			free(command->args[i]);
-		free(command->args);
+		size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+		chunk = malloc(sizeof(struct arena_chunk) + chunk_size);
+		chunk->size = chunk_size;
+		chunk->used = 0;
+		chunk->next = NULL;
+		if (arena->current == NULL)
+			arena->head = chunk;
+		else
+		{
+			struct arena_chunk *last = arena->current;
+			while (last->next != NULL)
+				last = last->next;
+			last->next = chunk;
+		}
+		arena->allocations++;
 	}
-	for (int i = 0; i < 3; ++i)
-		if (command->redirects[i])
-			free(command->redirects[i]);
-	if (command->next)
+	arena->current = chunk;
+	void *memory = chunk->data + chunk->used;
+	chunk->used += size;
+	return memory;
+}
+
+char *arena_strndup(struct arena *arena, const char *str, size_t len)
+{
+	char *copy = arena_alloc(arena, len + 1);
+	memcpy(copy, str, len);
+	copy[len] = 0;
+	return copy;
+}
+
+void arena_reset(struct arena *arena)
+{
+	/**
+	 * Releases every allocation at once, memory stays with the arena
+	 */
+	for (struct arena_chunk *chunk = arena->head; chunk != NULL; chunk = chunk->next)
+		chunk->used = 0;
+	arena->current = arena->head;
+}
+
+struct command_t *new_command()
+{
+	struct command_t *command = arena_alloc(&parse_arena, sizeof(struct command_t));
+	memset(command, 0, sizeof(struct command_t)); // set all bytes to 0
+	return command;
+}
+
+void push_arg(struct command_t *command, char *arg)
+{
+	/**
+	 * Appends to command->args, growing it geometrically
+	 */
+	if (command->arg_count == command->arg_capacity)
 	{
-		free_command(command->next);
-		command->next = NULL;
+		int capacity = command->arg_capacity ? command->arg_capacity * 2 : 4;
+		char **args = arena_alloc(&parse_arena, sizeof(char *) * capacity);
+		if (command->arg_count)
+			memcpy(args, command->args, sizeof(char *) * command->arg_count);
+		command->args = args;
+		command->arg_capacity = capacity;
 	}
-	free(command->name);
-	free(command);
-	return 0;
+	command->args[command->arg_count++] = arg;
 }
 
 /**
- * Show the command prompt
- * @return [description]
+ * Formats the command prompt
+ * @return length of the prompt
  */
-int show_prompt()
+int show_prompt(char *buf, size_t size)
 {
 	char cwd[1024], hostname[1024];
 	gethostname(hostname, sizeof(hostname));
 	getcwd(cwd, sizeof(cwd));
-	printf("%s@%s:%s %s$ ", getenv("USER"), hostname, cwd, sysname);
-	return 0;
+	int len = snprintf(buf, size, "%s@%s:%s %s$ ", getenv("USER"), hostname, cwd, sysname);
+	return len < (int)size ? len : (int)size - 1;
 }
 
 /**
- * Parse a command string into a command struct
- * @param  buf     [description]
- * @param  command [description]
- * @return         0
+ * Reads the next token of a line, words are unquoted and unescaped in place
+ * Runs in time linear to the token, the lexer keeps no hidden state
+ * @param  lexer   position in the line
+ * @param  token   filled with the token
+ * @return         token type
  */
-int parse_command(char *buf, struct command_t *command)
+int next_token(struct lexer_t *lexer, struct token_t *token)
 {
-	const char *splitters = " \t"; // split at whitespace
-	int index, len;
-	len = strlen(buf);
-	while (len > 0 && strchr(splitters, buf[0]) != NULL) // trim left whitespace
+	char *p = lexer->pos;
+	while (*p == ' ' || *p == '\t')
+		p++;
+	token->start = p;
+	token->len = 0;
+	token->redirect_index = -1;
+
+	int length = 1;
+	if (*p == 0)
 	{
-		buf++;
-		len--;
+		token->type = TOKEN_END;
+		length = 0;
 	}
-	while (len > 0 && strchr(splitters, buf[len - 1]) != NULL)
-		buf[--len] = 0; // trim right whitespace
-
-	if (len > 0 && buf[len - 1] == '?') // auto-complete
-		command->auto_complete = true;
-	if (len > 0 && buf[len - 1] == '&') // background
-		command->background = true;
-
-	char *pch = strtok(buf, splitters);
-	command->name = (char *)malloc(strlen(pch) + 1);
-	if (pch == NULL)
-		command->name[0] = 0;
+	else if (*p == '|')
+		token->type = TOKEN_PIPE;
+	else if (*p == '&' && p[1] != '>')
+		token->type = TOKEN_BACKGROUND;
 	else
-		strcpy(command->name, pch);
-
-	command->args = (char **)malloc(sizeof(char *));
-
-	int redirect_index;
-	int arg_index = 0;
-	char temp_buf[1024], *arg;
+	{
+		if (*p == '<')
+			token->redirect_index = 0;
+		else if (*p == '>')
+			token->redirect_index = p[1] == '>' ? 2 : 1;
+		else if (*p == '2' && p[1] == '>') // only at the start of a word
+			token->redirect_index = 3;
+		else if (*p == '&')
+			token->redirect_index = 4;
+		token->type = token->redirect_index == -1 ? TOKEN_WORD : TOKEN_REDIRECT;
+		length = token->redirect_index >= 2 ? 2 : 1; // >>, 2>, &>
+	}
 
-	while (1)
+	if (token->type != TOKEN_WORD)
 	{
-		// tokenize input on splitters
-		pch = strtok(NULL, splitters);
-		if (!pch)
-			break;
-		arg = temp_buf;
-		strcpy(arg, pch);
-		len = strlen(arg);
+		token->len = length;
+		lexer->pos = p + length;
+		return token->type;
+	}
 
-		if (len == 0)
-			continue;										 // empty arg, go for next
-		while (len > 0 && strchr(splitters, arg[0]) != NULL) // trim left whitespace
+	// Word, compacted towards its start as quotes and backslashes are dropped
+	char *out = p;
+	char quote = 0;
+	while (*p)
+	{
+		char c = *p;
+		if (quote)
 		{
-			arg++;
-			len--;
+			if (c == quote)
+			{
+				quote = 0;
+				p++;
+				continue;
+			}
+			if (quote == '"' && c == '\\' && (p[1] == '"' || p[1] == '\\'))
+				c = *++p;
 		}
-		while (len > 0 && strchr(splitters, arg[len - 1]) != NULL)
-			arg[--len] = 0; // trim right whitespace
-		if (len == 0)
-			continue; // empty arg, go for next
-
+		else
+		{
+			if (c == ' ' || c == '\t' || c == '|' || c == '&' || c == '<' || c == '>')
+				break;
+			if (c == '\'' || c == '"')
+			{
+				quote = c;
+				p++;
+				continue;
+			}
+			if (c == '\\' && p[1])
+				c = *++p;
+		}
+		*out++ = c;
+		p++;
+	}
+	token->len = out - token->start;
+	lexer->pos = p;
+	return TOKEN_WORD;
+}
+
+/**
+ * Parse a command string into a command struct
+ * Arguments point into one arena copy of the line
+ * @param  buf     [description]
+ * @param  command [description]
+ * @return         0, -1 on a syntax error
+ */
+int parse_command(char *buf, struct command_t *command)
+{
+	int len = strlen(buf);
+	while (len > 0 && (buf[len - 1] == ' ' || buf[len - 1] == '\t'))
+		len--;
+	char *line = arena_strndup(&parse_arena, buf, len);
+	struct token_t *tokens = arena_alloc(&parse_arena, sizeof(struct token_t) * (len + 1));
+	struct lexer_t lexer = {line};
+	int token_count = 0;
+	while (next_token(&lexer, &tokens[token_count++]) != TOKEN_END)
+		;
+
+	// Every delimiter is consumed now, words can be terminated in place
+	for (int i = 0; i < token_count; i++)
+		if (tokens[i].type == TOKEN_WORD)
+			tokens[i].start[tokens[i].len] = 0;
+
+	struct command_t *current = command;
+	struct token_t *error = NULL; // unexpected token
+	for (int i = 0; i < token_count - 1 && error == NULL; i++)
+	{
+		struct token_t *token = &tokens[i];
+		if (token->type == TOKEN_WORD)
+		{
+			if (current->name == NULL)
+				current->name = token->start;
+			else
+				push_arg(current, token->start);
+		}
+		else if (token->type == TOKEN_PIPE)
+		{
+			if (current->name == NULL)
+				error = token;
+			current->next = new_command(); // piping to another command
+			current = current->next;
+		}
+		else if (token->type == TOKEN_BACKGROUND)
+			command->background = true;
+		else if (tokens[i + 1].type != TOKEN_WORD) // redirect needs a file name
+			error = &tokens[i + 1];
+		else
+			current->redirects[token->redirect_index] = tokens[++i].start;
+	}
+	if (error == NULL && current != command && current->name == NULL)
+		error = &tokens[token_count - 1];
+
+	if (error != NULL)
+	{
+		if (error->type == TOKEN_END)
+			printf("-%s: syntax error near unexpected token `newline'\n", sysname);
+		else
+			printf("-%s: syntax error near unexpected token `%.*s'\n", sysname, (int)error->len, error->start);
+		memset(command, 0, sizeof(struct command_t));
+	}
+	for (current = command; current != NULL; current = current->next)
+		if (current->name == NULL)
+			current->name = "";
+	return error == NULL ? 0 : -1;
+}
+
+/**
+ * Previous strtok based parser, kept for comparing parse_command against
+ * @param  buf     [description]
+ * @param  command [description]
+ * @return         0
+ */
+int parse_command_strtok(char *buf, struct command_t *command)
+{
+	const char *splitters = " \t"; // split at whitespace
+	int index, len;
+	len = strlen(buf);
+	while (len > 0 && strchr(splitters, buf[0]) != NULL) // trim left whitespace
+	{
+		buf++;
+		len--;
+	}
+	while (len > 0 && strchr(splitters, buf[len - 1]) != NULL)
+		buf[--len] = 0; // trim right whitespace
+
+	if (len > 0 && buf[len - 1] == '&') // background
+		command->background = true;
+
+	char *pch = strtok(buf, splitters);
+	if (pch == NULL)
+		command->name = arena_strndup(&parse_arena, "", 0);
+	else
+		command->name = arena_strndup(&parse_arena, pch, strlen(pch));
+
+	int redirect_index;
+	char temp_buf[1024], *arg;
+
+	while (1)
+	{
+		// tokenize input on splitters
+		pch = strtok(NULL, splitters);
+		if (!pch)
+			break;
+		arg = temp_buf;
+		strcpy(arg, pch);
+		len = strlen(arg);
+
+		if (len == 0)
+			continue;										 // empty arg, go for next
+		while (len > 0 && strchr(splitters, arg[0]) != NULL) // trim left whitespace
+		{
+			arg++;
+			len--;
+		}
+		while (len > 0 && strchr(splitters, arg[len - 1]) != NULL)
+			arg[--len] = 0; // trim right whitespace
+		if (len == 0)
+			continue; // empty arg, go for next
+
 		// piping to another command
 		if (strcmp(arg, "|") == 0)
 		{
-			struct command_t *c = malloc(sizeof(struct command_t));
+			struct command_t *c = new_command();
 			int l = strlen(pch);
 			pch[l] = splitters[0]; // restore strtok termination
 			index = 1;
 			while (pch[index] == ' ' || pch[index] == '\t')
 				index++; // skip whitespaces
 
-			parse_command(pch + index, c);
+			parse_command_strtok(pch + index, c);
 			pch[l] = 0; // put back strtok termination
 			command->next = c;
 			continue;
@@ -200,8 +941,7 @@ int parse_command(char *buf, struct command_t *command)
 		}
 		if (redirect_index != -1)
 		{
-			command->redirects[redirect_index] = malloc(len);
-			strcpy(command->redirects[redirect_index], arg + 1);
+			command->redirects[redirect_index] = arena_strndup(&parse_arena, arg + 1, len - 1);
 			continue;
 		}
 
@@ -211,747 +951,5357 @@ int parse_command(char *buf, struct command_t *command)
 			arg[--len] = 0;
 			arg++;
 		}
-		command->args = (char **)realloc(command->args, sizeof(char *) * (arg_index + 1));
-		command->args[arg_index] = (char *)malloc(len + 1);
-		strcpy(command->args[arg_index++], arg);
+		push_arg(command, arena_strndup(&parse_arena, arg, len));
 	}
-	command->arg_count = arg_index;
 	return 0;
 }
 
-void prompt_backspace()
+long long profile_now()
 {
-	putchar(8);	  // go back 1
-	putchar(' '); // write empty over
-	putchar(8);	  // go back 1 again
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
 }
 
-/**
- * Prompt a command from the user
- * @param  buf      [description]
- * @param  buf_size [description]
- * @return          [description]
- */
-int prompt(struct command_t *command)
+long long profile_begin()
 {
-	int index = 0;
-	char c;
-	char buf[4096];
-	static char oldbuf[4096];
-
-	// tcgetattr gets the parameters of the current terminal
-	// STDIN_FILENO will tell tcgetattr that it should write the settings
-	// of stdin to oldt
-	static struct termios backup_termios, new_termios;
-	tcgetattr(STDIN_FILENO, &backup_termios);
-	new_termios = backup_termios;
-	// ICANON normally takes care that one line at a time will be processed
-	// that means it will return if it sees a "\n" or an EOF or an EOL
-	new_termios.c_lflag &= ~(ICANON | ECHO); // Also disable automatic echo. We manually echo each char.
-	// Those new settings will be set to STDIN
-	// TCSANOW tells tcsetattr to change attributes immediately.
-	tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
-
-	// FIXME: backspace is applied before printing chars
-	show_prompt();
-	int multicode_state = 0;
-	buf[0] = 0;
+	/**
+	 * @return start time for profile_end, 0 when the profiler is off
+	 */
+	return profiler.enabled ? profile_now() : 0;
+}
 
-	while (1)
+int profile_bucket(long long ns)
+{
+	if (ns < 8)
+		return ns < 0 ? 0 : ns;
+	int log = 63 - __builtin_clzll(ns);
+	return (log - 2) * 8 + ((ns >> (log - 3)) & 7);
+}
+
+long long profile_bucket_limit(int bucket)
+{
+	/**
+	 * @return the largest value falling into bucket
+	 */
+	if (bucket < 8)
+		return bucket;
+	int log = bucket / 8 + 2;
+	return ((8LL + bucket % 8 + 1) << (log - 3)) - 1;
+}
+
+void profile_end(int stage, long long start, const char *label)
+{
+	if (start == 0 || !profiler.enabled)
+		return;
+	long long duration = profile_now() - start;
+	profiler.buckets[stage][profile_bucket(duration)]++;
+	profiler.samples[stage]++;
+	profiler.total[stage] += duration;
+	if (duration > profiler.max[stage])
+		profiler.max[stage] = duration;
+
+	if (profiler.event_count == PROFILE_MAX_EVENTS)
+	{
+		profiler.dropped++;
+		return;
+	}
+	if (profiler.events == NULL)
+		profiler.events = malloc(PROFILE_MAX_EVENTS * sizeof(struct profile_event));
+	struct profile_event *event = &profiler.events[profiler.event_count++];
+	event->stage = stage;
+	event->start = start - profiler.epoch;
+	event->duration = duration;
+	snprintf(event->label, sizeof(event->label), "%s", label != NULL ? label : "");
+}
+
+void format_duration(char *buf, size_t size, long long ns)
+{
+	if (ns < 1000)
+		snprintf(buf, size, "%lld ns", ns);
+	else if (ns < 1000000)
+		snprintf(buf, size, "%.1f us", ns / 1e3);
+	else if (ns < 1000000000)
+		snprintf(buf, size, "%.1f ms", ns / 1e6);
+	else
+		snprintf(buf, size, "%.2f s", ns / 1e9);
+}
+
+long long profile_percentile(int stage, double fraction)
+{
+	long long wanted = profiler.samples[stage] * fraction, seen = 0;
+	for (int bucket = 0; bucket < PROFILE_BUCKETS; bucket++)
+	{
+		seen += profiler.buckets[stage][bucket];
+		if (seen > wanted)
+			return profile_bucket_limit(bucket) < profiler.max[stage] ? profile_bucket_limit(bucket) : profiler.max[stage];
+	}
+	return profiler.max[stage];
+}
+
+void profile_report()
+{
+	/**
+	 * Prints count, mean, percentiles and maximum of each stage
+	 * Percentiles are read from the histogram and are accurate to an eighth of a power of two
+	 */
+	printf("%-10s %8s %10s %10s %10s %10s %10s\n", "stage", "count", "mean", "p50", "p90", "p99", "max");
+	for (int stage = 0; stage < PROFILE_STAGES; stage++)
 	{
-		c = getchar();
-		// printf("Keycode: %u\n", c); // DEBUG: uncomment for debugging
+		if (profiler.samples[stage] == 0)
+			continue;
+		char mean[16], p50[16], p90[16], p99[16], max[16];
+		format_duration(mean, sizeof(mean), profiler.total[stage] / profiler.samples[stage]);
+		format_duration(p50, sizeof(p50), profile_percentile(stage, 0.5));
+		format_duration(p90, sizeof(p90), profile_percentile(stage, 0.9));
+		format_duration(p99, sizeof(p99), profile_percentile(stage, 0.99));
+		format_duration(max, sizeof(max), profiler.max[stage]);
+		printf("%-10s %8lld %10s %10s %10s %10s %10s\n", profile_stage_names[stage], profiler.samples[stage], mean, p50, p90, p99, max);
+	}
+	if (profiler.dropped > 0)
+		printf("%lld events past the first %d are not in the trace\n", profiler.dropped, PROFILE_MAX_EVENTS);
+}
 
-		if (c == 9) // handle tab
+int profile_write_trace(const char *path)
+{
+	/**
+	 * Writes the recorded events in the Chrome trace event format
+	 */
+	FILE *file = fopen(path, "w");
+	if (file == NULL)
+		return -1;
+	fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	for (int i = 0; i < profiler.event_count; i++)
+	{
+		struct profile_event *event = &profiler.events[i];
+		char label[2 * sizeof(event->label)], *out = label;
+		for (char *c = event->label; *c; c++)
 		{
-			buf[index++] = '?'; // autocomplete
-			break;
+			if (*c == '"' || *c == '\\')
+				*out++ = '\\';
+			*out++ = (unsigned char)*c < 32 ? ' ' : *c;
 		}
+		*out = 0;
+		fprintf(file, "{\"name\":\"%s\",\"cat\":\"shellfyre\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"command\":\"%s\"}}%s\n",
+				profile_stage_names[event->stage], event->start / 1e3, event->duration / 1e3, getpid(), event->stage,
+				label, i + 1 < profiler.event_count ? "," : "");
+	}
+	fprintf(file, "]}\n");
+	return fclose(file);
+}
+
+void profile_exit()
+{
+	if (profiler.trace_file != NULL && profile_write_trace(profiler.trace_file) == -1)
+		printf("-%s: %s: %s\n", sysname, profiler.trace_file, strerror(errno));
+	if (profiler.summary)
+		profile_report();
+}
+
+void terminal_raw()
+{
+	/**
+	 * Switches the terminal to raw mode, only the first call reads its settings
+	 */
+	if (terminal_is_raw)
+		return;
+	if (!terminal_saved)
+	{
+		tcgetattr(STDIN_FILENO, &cooked_termios);
+		raw_termios = cooked_termios;
+		// No line buffering, echo or signal keys, the editor handles them all
+		raw_termios.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+		raw_termios.c_iflag &= ~(ICRNL | IXON);
+		raw_termios.c_cc[VMIN] = 1;
+		raw_termios.c_cc[VTIME] = 0;
+		terminal_saved = true;
+	}
+	tcsetattr(STDIN_FILENO, TCSADRAIN, &raw_termios);
+	terminal_is_raw = true;
+}
+
+void terminal_cooked()
+{
+	/**
+	 * Gives the terminal its original settings back, for jobs and builtins reading lines
+	 */
+	if (!terminal_is_raw)
+		return;
+	tcsetattr(STDIN_FILENO, TCSADRAIN, &cooked_termios);
+	terminal_is_raw = false;
+}
+
+unsigned long long history_bigrams(const char *text, int len)
+{
+	unsigned long long mask = 0;
+	for (int i = 0; i + 1 < len; i++)
+		mask |= 1ULL << (((unsigned char)text[i] * 31 + (unsigned char)text[i + 1]) & 63);
+	return mask;
+}
+
+char *home_file(const char *name)
+{
+	/**
+	 * Path of name in the user's home directory, from $HOME or else the password database
+	 * Built once at startup for the files the shell keeps between sessions
+	 */
+	const char *home = getenv("HOME");
+	if (home == NULL || *home == 0)
+	{
+		struct passwd *entry = getpwuid(getuid());
+		home = entry != NULL ? entry->pw_dir : "/";
+	}
+	size_t size = strlen(home) + strlen(name) + 2;
+	char *path = malloc(size);
+	snprintf(path, size, "%s/%s", home, name);
+	return path;
+}
+
+bool history_open()
+{
+	if (history.fd == -1)
+		history.fd = open(command_history, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	return history.fd != -1;
+}
+
+void history_sync()
+{
+	/**
+	 * Maps command_history again if it grew and indexes the new lines,
+	 * so entries appended by other shells show up in between ours
+	 */
+	struct stat st;
+	if (!history_open() || fstat(history.fd, &st) == -1)
+		return;
+	if ((size_t)st.st_size < history.indexed) // truncated, start over
+		history.indexed = history.count = 0;
+	else if ((size_t)st.st_size == history.map_length)
+		return;
+
+	if (history.map)
+		munmap(history.map, history.map_length);
+	history.map = NULL;
+	history.map_length = 0;
+	if (st.st_size == 0)
+		return;
+	char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, history.fd, 0);
+	if (map == MAP_FAILED)
+		return;
+	history.map = map;
+	history.map_length = st.st_size;
 
-		if (c == 127) // handle backspace
+	char *end = map + st.st_size;
+	char *line = map + history.indexed;
+	char *newline;
+	while (line < end && (newline = memchr(line, '\n', end - line)) != NULL)
+	{
+		if (newline > line)
 		{
-			if (index > 0)
+			if (history.count == history.capacity)
 			{
-				prompt_backspace();
-				index--;
+				history.capacity = history.capacity ? history.capacity * 2 : 1024;
+				history.entries = realloc(history.entries, history.capacity * sizeof(struct history_entry));
 			}
-			continue;
+			struct history_entry *entry = &history.entries[history.count++];
+			entry->offset = line - map;
+			entry->len = newline - line;
+			entry->bigrams = history_bigrams(line, entry->len);
 		}
-		if (c == 27 && multicode_state == 0) // handle multi-code keys
+		line = newline + 1;
+	}
+	history.indexed = line - map;
+
+	// Lines we appended are in the map now
+	int kept = 0;
+	for (int i = 0; i < history.ring_count; i++)
+	{
+		if (history.ring_saved[i])
 		{
-			multicode_state = 1;
+			free(history.ring[i]);
 			continue;
 		}
-		if (c == 91 && multicode_state == 1)
-		{
-			multicode_state = 2;
+		history.ring[kept] = history.ring[i];
+		history.ring_bigrams[kept] = history.ring_bigrams[i];
+		history.ring_saved[kept++] = false;
+	}
+	history.ring_count = kept;
+}
+
+int history_total()
+{
+	return history.count + history.ring_count;
+}
+
+const char *history_get(int index, int *len)
+{
+	if (index < history.count)
+	{
+		*len = history.entries[index].len;
+		return history.map + history.entries[index].offset;
+	}
+	*len = strlen(history.ring[index - history.count]);
+	return history.ring[index - history.count];
+}
+
+int history_search(const char *query, int query_len, int from, int step, bool prefix)
+{
+	/**
+	 * Finds the first entry from index from in direction step containing query, or starting with it
+	 * The bigram masks rule out most entries without touching their text
+	 * @return index of the entry, -1 if none
+	 */
+	unsigned long long mask = history_bigrams(query, query_len);
+	for (int i = from; i >= 0 && i < history_total(); i += step)
+	{
+		unsigned long long bigrams = i < history.count ? history.entries[i].bigrams : history.ring_bigrams[i - history.count];
+		if ((bigrams & mask) != mask)
 			continue;
-		}
-		if (c == 65 && multicode_state == 2) // up arrow
+		int len;
+		const char *text = history_get(i, &len);
+		if (prefix ? len >= query_len && memcmp(text, query, query_len) == 0
+				   : memmem(text, len, query, query_len) != NULL)
+			return i;
+	}
+	return -1;
+}
+
+void history_add(const char *line)
+{
+	/**
+	 * Appends line to command_history under an exclusive lock, one write per line
+	 */
+	int len = strlen(line);
+	if (len == 0 || strchr(line, '\n'))
+		return;
+	int last_len;
+	if (history_total() > 0)
+	{
+		const char *last = history_get(history_total() - 1, &last_len);
+		if (last_len == len && memcmp(last, line, len) == 0)
+			return;
+	}
+
+	if (history.ring_count == HISTORY_RING_SIZE)
+		history_sync();
+	if (history.ring_count == HISTORY_RING_SIZE) // could not be saved, drop the oldest
+	{
+		free(history.ring[0]);
+		memmove(history.ring, history.ring + 1, (HISTORY_RING_SIZE - 1) * sizeof(char *));
+		memmove(history.ring_bigrams, history.ring_bigrams + 1, (HISTORY_RING_SIZE - 1) * sizeof(unsigned long long));
+		memmove(history.ring_saved, history.ring_saved + 1, (HISTORY_RING_SIZE - 1) * sizeof(bool));
+		history.ring_count--;
+	}
+
+	bool saved = false;
+	if (history_open())
+	{
+		struct iovec record[2] = {{(char *)line, len}, {"\n", 1}};
+		flock(history.fd, LOCK_EX);
+		saved = writev(history.fd, record, 2) == len + 1;
+		flock(history.fd, LOCK_UN);
+	}
+	int slot = history.ring_count++;
+	history.ring[slot] = strdup(line);
+	history.ring_bigrams[slot] = history_bigrams(line, len);
+	history.ring_saved[slot] = saved;
+}
+
+void trie_insert(struct trie_node **root, const char *name)
+{
+	struct trie_node **link = root;
+	struct trie_node *node = NULL;
+	for (; *name; name++)
+	{
+		while (*link != NULL && (unsigned char)(*link)->c < (unsigned char)*name)
+			link = &(*link)->sibling;
+		if (*link == NULL || (*link)->c != *name)
 		{
-			int i;
-			while (index > 0)
-			{
-				prompt_backspace();
-				index--;
-			}
-			for (i = 0; oldbuf[i]; ++i)
-			{
-				putchar(oldbuf[i]);
-				buf[i] = oldbuf[i];
-			}
-			index = i;
-			continue;
+			struct trie_node *added = arena_alloc(&trie_arena, sizeof(struct trie_node));
+			added->c = *name;
+			added->terminal = false;
+			added->child = NULL;
+			added->sibling = *link;
+			*link = added;
 		}
-		else
-			multicode_state = 0;
+		node = *link;
+		link = &node->child;
+	}
+	if (node != NULL)
+		node->terminal = true;
+}
 
-		putchar(c); // echo the character
-		buf[index++] = c;
-		if (index >= sizeof(buf) - 1)
-			break;
-		if (c == '\n') // enter key
+void trie_collect(struct trie_node *node, char *name, int depth, char **items, int *count)
+{
+	/**
+	 * Adds every name below node to items in sorted order, name holds the prefix so far
+	 */
+	for (; node != NULL && *count < COMPLETION_MAX && depth < LINE_SIZE - 1; node = node->sibling)
+	{
+		name[depth] = node->c;
+		if (node->terminal)
+			items[(*count)++] = arena_strndup(&completion_arena, name, depth + 1);
+		trie_collect(node->child, name, depth + 1, items, count);
+	}
+}
+
+void refresh_command_trie()
+{
+	/**
+	 * Rebuilds command_trie from the builtins and PATH if PATH or one of its directories changed
+	 */
+	const char *path_env = getenv("PATH") != NULL ? getenv("PATH") : "/usr/local/bin:/usr/bin:/bin";
+	bool stale = trie_path_env == NULL || strcmp(trie_path_env, path_env) != 0;
+	char dirs[strlen(path_env) + 1];
+	strcpy(dirs, path_env);
+
+	int dir_count = 0;
+	struct timespec mtimes[COMPLETION_PATH_DIRS];
+	for (char *save, *dir = strtok_r(dirs, ":", &save); dir != NULL && dir_count < COMPLETION_PATH_DIRS; dir = strtok_r(NULL, ":", &save))
+	{
+		struct stat st;
+		memset(&mtimes[dir_count], 0, sizeof(struct timespec));
+		if (stat(dir, &st) == 0)
+			mtimes[dir_count] = st.st_mtim;
+		if (mtimes[dir_count].tv_sec != trie_mtimes[dir_count].tv_sec || mtimes[dir_count].tv_nsec != trie_mtimes[dir_count].tv_nsec)
+			stale = true;
+		dir_count++;
+	}
+	if (!stale)
+		return;
+
+	arena_reset(&trie_arena);
+	command_trie = NULL;
+	for (int i = 0; i < BUILTIN_SLOTS; i++)
+		if (builtins[i].name != NULL)
+			trie_insert(&command_trie, builtins[i].name);
+
+	strcpy(dirs, path_env);
+	for (char *save, *dir = strtok_r(dirs, ":", &save); dir != NULL; dir = strtok_r(NULL, ":", &save))
+	{
+		DIR *stream = opendir(dir);
+		if (stream == NULL)
+			continue;
+		struct dirent *entry;
+		while ((entry = readdir(stream)) != NULL)
+			if (entry->d_name[0] != '.' && entry->d_type != DT_DIR && faccessat(dirfd(stream), entry->d_name, X_OK, 0) == 0)
+				trie_insert(&command_trie, entry->d_name);
+		closedir(stream);
+	}
+	memcpy(trie_mtimes, mtimes, dir_count * sizeof(struct timespec));
+	free(trie_path_env);
+	trie_path_env = strdup(path_env);
+}
+
+int compare_completion_entries(const void *a, const void *b)
+{
+	return strcmp(((const struct completion_entry *)a)->name, ((const struct completion_entry *)b)->name);
+}
+
+struct completion_dir *list_directory(const char *path)
+{
+	/**
+	 * Returns the sorted entries of path, read again only when its mtime changed
+	 */
+	struct stat st;
+	if (stat(path, &st) == -1 || !S_ISDIR(st.st_mode))
+		return NULL;
+	struct completion_dir *slot = &completion_dirs[0];
+	for (int i = 0; i < COMPLETION_DIR_CACHE; i++)
+	{
+		struct completion_dir *cached = &completion_dirs[i];
+		if (cached->path != NULL && strcmp(cached->path, path) == 0)
+		{
+			slot = cached;
 			break;
-		if (c == 4) // Ctrl+D
-			return EXIT;
+		}
+		if (cached->used < slot->used)
+			slot = cached;
 	}
-	if (index > 0 && buf[index - 1] == '\n') // trim newline from the end
-		index--;
-	buf[index++] = 0; // null terminate string
+	slot->used = ++completion_clock;
+	if (slot->path != NULL && strcmp(slot->path, path) == 0 &&
+		slot->mtime.tv_sec == st.st_mtim.tv_sec && slot->mtime.tv_nsec == st.st_mtim.tv_nsec)
+		return slot;
 
-	strcpy(oldbuf, buf);
+	for (int i = 0; i < slot->count; i++)
+		free(slot->entries[i].name);
+	free(slot->entries);
+	free(slot->path);
+	slot->path = strdup(path);
+	slot->mtime = st.st_mtim;
+	slot->entries = NULL;
+	slot->count = 0;
 
-	parse_command(buf, command);
+	DIR *stream = opendir(path);
+	if (stream == NULL)
+		return slot;
+	int capacity = 0;
+	struct dirent *entry;
+	while ((entry = readdir(stream)) != NULL)
+	{
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+			continue;
+		if (slot->count == capacity)
+		{
+			capacity = capacity ? capacity * 2 : 64;
+			slot->entries = realloc(slot->entries, capacity * sizeof(struct completion_entry));
+		}
+		bool is_dir = entry->d_type == DT_DIR;
+		if (entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) // follow links to directories
+			is_dir = fstatat(dirfd(stream), entry->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+		slot->entries[slot->count].name = strdup(entry->d_name);
+		slot->entries[slot->count++].is_dir = is_dir;
+	}
+	closedir(stream);
+	qsort(slot->entries, slot->count, sizeof(struct completion_entry), compare_completion_entries);
+	return slot;
+}
 
-	// print_command(command); // DEBUG: uncomment for debugging
+int complete_word(const char *word, bool command_position, char **items, int *display_offset)
+{
+	/**
+	 * Fills items with the completions of word, command names in command position and paths otherwise
+	 * Directories end with a slash, items are valid until the next call
+	 * @return number of items
+	 */
+	arena_reset(&completion_arena);
+	int count = 0;
+	*display_offset = 0;
+	if (command_position && strchr(word, '/') == NULL)
+	{
+		refresh_command_trie();
+		// Walk down the prefix, then every name below it completes word
+		struct trie_node *list = command_trie, *node = NULL;
+		const char *c = word;
+		for (; *c && list != NULL; c++)
+		{
+			for (node = list; node != NULL && node->c != *c; node = node->sibling)
+				;
+			list = node != NULL ? node->child : NULL;
+			if (node == NULL)
+				return 0;
+		}
+		if (*c != 0) // word runs past a leaf, no name starts with it
+			return 0;
+		char name[LINE_SIZE];
+		int len = strlen(word);
+		memcpy(name, word, len);
+		if (node != NULL && node->terminal)
+			items[count++] = arena_strndup(&completion_arena, word, len);
+		trie_collect(len > 0 ? list : command_trie, name, len, items, &count);
+		return count;
+	}
+
+	const char *slash = strrchr(word, '/');
+	int dir_len = slash ? slash - word + 1 : 0;
+	const char *prefix = word + dir_len;
+	int prefix_len = strlen(prefix);
+	char dir[dir_len + 2];
+	snprintf(dir, sizeof(dir), "%.*s", dir_len, word);
+	if (dir_len == 0)
+		strcpy(dir, ".");
+	struct completion_dir *listing = list_directory(dir);
+	if (listing == NULL)
+		return 0;
+	*display_offset = dir_len;
+
+	// First entry not below prefix, the matches follow it
+	int low = 0, high = listing->count;
+	while (low < high)
+	{
+		int mid = (low + high) / 2;
+		if (strncmp(listing->entries[mid].name, prefix, prefix_len) < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	for (int i = low; i < listing->count && count < COMPLETION_MAX && strncmp(listing->entries[i].name, prefix, prefix_len) == 0; i++)
+	{
+		struct completion_entry *entry = &listing->entries[i];
+		if (entry->name[0] == '.' && prefix[0] != '.') // hidden unless asked for
+			continue;
+		int name_len = strlen(entry->name);
+		char *item = arena_alloc(&completion_arena, dir_len + name_len + 2);
+		snprintf(item, dir_len + name_len + 2, "%.*s%s%s", dir_len, word, entry->name, entry->is_dir ? "/" : "");
+		items[count++] = item;
+	}
+	return count;
+}
+
+void print_completions(char **items, int count, int display_offset, int cols, const char *newline)
+{
+	/**
+	 * Prints items in columns, newline is \r\n while the terminal is raw
+	 */
+	int width = 0;
+	for (int i = 0; i < count; i++)
+		if ((int)strlen(items[i] + display_offset) > width)
+			width = strlen(items[i] + display_offset);
+	width += 2;
+	int columns = cols / width > 0 ? cols / width : 1;
+	int rows = (count + columns - 1) / columns;
+	for (int row = 0; row < rows; row++)
+	{
+		for (int column = 0; column < columns; column++)
+		{
+			int i = column * rows + row;
+			if (i < count)
+				printf("%-*s", i + rows < count ? width : 0, items[i] + display_offset);
+		}
+		printf("%s", newline);
+	}
+	fflush(stdout);
+}
+
+void editor_append(char *out, int *out_len, const char *data, int len)
+{
+	if (*out_len + len > LINE_SIZE * 4)
+		len = LINE_SIZE * 4 - *out_len;
+	memcpy(out + *out_len, data, len);
+	*out_len += len;
+}
+
+void editor_refresh()
+{
+	/**
+	 * Redraws the current physical line and its wrapped rows with a single write()
+	 */
+	char out[LINE_SIZE * 4];
+	int out_len = 0;
+	char seq[32];
+	int seq_len;
+
+	// Back to the first row, then clear everything below
+	if (editor.cursor_row > 0)
+	{
+		seq_len = snprintf(seq, sizeof(seq), "\x1b[%dA", editor.cursor_row);
+		editor_append(out, &out_len, seq, seq_len);
+	}
+	editor_append(out, &out_len, "\r\x1b[J", 4);
+	editor_append(out, &out_len, editor.prompt, editor.prompt_len);
+	editor_append(out, &out_len, editor.buf + editor.segment_start, editor.len - editor.segment_start);
+
+	int end = editor.prompt_len + editor.len - editor.segment_start;
+	int cursor = editor.prompt_len + editor.pos - editor.segment_start;
+	int end_row = end / editor.cols;
+	if (end > 0 && end % editor.cols == 0) // terminal waits to wrap, force it
+		editor_append(out, &out_len, "\n", 1);
+
+	int cursor_row = cursor / editor.cols;
+	if (end_row > cursor_row)
+	{
+		seq_len = snprintf(seq, sizeof(seq), "\x1b[%dA", end_row - cursor_row);
+		editor_append(out, &out_len, seq, seq_len);
+	}
+	editor_append(out, &out_len, "\r", 1);
+	if (cursor % editor.cols > 0)
+	{
+		seq_len = snprintf(seq, sizeof(seq), "\x1b[%dC", cursor % editor.cols);
+		editor_append(out, &out_len, seq, seq_len);
+	}
+	editor.cursor_row = cursor_row;
+	write(STDOUT_FILENO, out, out_len);
+}
+
+void editor_insert(const char *data, int len)
+{
+	if (editor.len + len >= LINE_SIZE - 1)
+		len = LINE_SIZE - 1 - editor.len;
+	memmove(editor.buf + editor.pos + len, editor.buf + editor.pos, editor.len - editor.pos);
+	memcpy(editor.buf + editor.pos, data, len);
+	editor.len += len;
+	editor.pos += len;
+}
+
+void editor_delete(int from, int to)
+{
+	/**
+	 * Removes buf[from, to) of the current physical line
+	 */
+	if (from < editor.segment_start)
+		from = editor.segment_start;
+	if (to > editor.len)
+		to = editor.len;
+	if (from >= to)
+		return;
+	memmove(editor.buf + from, editor.buf + to, editor.len - to);
+	editor.len -= to - from;
+	if (editor.pos >= to)
+		editor.pos -= to - from;
+	else if (editor.pos > from)
+		editor.pos = from;
+}
+
+void editor_replace(const char *line, int len)
+{
+	/**
+	 * Swaps the current physical line for line, used by history
+	 */
+	editor.len = editor.pos = editor.segment_start;
+	editor_insert(line, len);
+}
+
+void editor_set_prompt(const char *prompt)
+{
+	editor.prompt_len = snprintf(editor.prompt, sizeof(editor.prompt), "%s", prompt);
+	strcpy(editor.line_prompt, editor.prompt);
+}
+
+void editor_save_line()
+{
+	editor.saved_len = editor.len - editor.segment_start;
+	memcpy(editor.saved_line, editor.buf + editor.segment_start, editor.saved_len);
+}
+
+void editor_history_move(int step)
+{
+	/**
+	 * Up and down arrows, walks the entries starting with what was typed before the first up arrow
+	 */
+	if (editor.history_pos == -1)
+	{
+		history_sync();
+		editor_save_line();
+		editor.history_pos = history_total();
+	}
+	int from = editor.history_pos + step;
+	int found, len;
+	const char *text;
+	while ((found = history_search(editor.saved_line, editor.saved_len, from, step, true)) != -1)
+	{
+		// Skip entries that look the same as the current line
+		text = history_get(found, &len);
+		if (len != editor.len - editor.segment_start || memcmp(text, editor.buf + editor.segment_start, len) != 0)
+			break;
+		from = found + step;
+	}
+	if (found != -1)
+	{
+		editor.history_pos = found;
+		editor_replace(text, len);
+	}
+	else if (step > 0)
+	{
+		editor.history_pos = history_total();
+		editor_replace(editor.saved_line, editor.saved_len);
+	}
+}
+
+void editor_search_update(int from)
+{
+	/**
+	 * Ctrl+R, looks for the query backwards from entry from and shows the match
+	 */
+	int found = editor.query_len ? history_search(editor.query, editor.query_len, from, -1, false) : -1;
+	if (found != -1)
+	{
+		int len;
+		const char *text = history_get(found, &len);
+		editor.match = found;
+		editor_replace(text, len);
+		editor.pos = editor.segment_start + ((const char *)memmem(text, len, editor.query, editor.query_len) - text);
+	}
+	editor.prompt_len = snprintf(editor.prompt, sizeof(editor.prompt), "(%sreverse-i-search)`%.*s': ",
+								 found == -1 && editor.query_len ? "failed " : "", editor.query_len, editor.query);
+}
+
+void editor_search_end()
+{
+	editor.searching = false;
+	editor.prompt_len = snprintf(editor.prompt, sizeof(editor.prompt), "%s", editor.line_prompt);
+}
+
+bool editor_search_key(char c)
+{
+	/**
+	 * Handles a key while searching
+	 * @return false if the search ended and the key still needs to be handled
+	 */
+	if (c == 18) // Ctrl+R, next older match
+		editor_search_update(editor.match == -1 ? history_total() - 1 : editor.match - 1);
+	else if (c == 127 || c == 8)
+	{
+		if (editor.query_len > 0)
+			editor.query_len--;
+		editor_search_update(history_total() - 1);
+	}
+	else if (c == 7 || c == 3) // Ctrl+G or Ctrl+C, back to the line before the search
+	{
+		editor_replace(editor.saved_line, editor.saved_len);
+		editor_search_end();
+	}
+	else if ((unsigned char)c >= 32 && c != 127)
+	{
+		if (editor.query_len < (int)sizeof(editor.query))
+			editor.query[editor.query_len++] = c;
+		editor_search_update(editor.match == -1 ? history_total() - 1 : editor.match);
+	}
+	else
+	{
+		editor_search_end();
+		return false;
+	}
+	return true;
+}
+
+void editor_complete()
+{
+	/**
+	 * Tab, completes the word before the cursor as far as all its completions agree,
+	 * lists them when they do not agree any further
+	 */
+	int start = editor.pos;
+	while (start > editor.segment_start && strchr(" |&<>", editor.buf[start - 1]) == NULL)
+		start--;
+	char word[LINE_SIZE];
+	int word_len = 0;
+	for (int i = start; i < editor.pos; i++)
+	{
+		if (editor.buf[i] == '\\' && i + 1 < editor.pos)
+			i++;
+		word[word_len++] = editor.buf[i];
+	}
+	word[word_len] = 0;
+
+	int before = start;
+	while (before > 0 && editor.buf[before - 1] == ' ')
+		before--;
+	bool command_position = before == 0 || editor.buf[before - 1] == '|' || editor.buf[before - 1] == '&';
+
+	static char *items[COMPLETION_MAX];
+	int display_offset;
+	int count = complete_word(word, command_position, items, &display_offset);
+	if (count == 0)
+	{
+		write(STDOUT_FILENO, "\a", 1);
+		return;
+	}
+
+	int common = strlen(items[0]);
+	for (int i = 1; i < count; i++)
+	{
+		int same = 0;
+		while (same < common && items[i][same] == items[0][same])
+			same++;
+		common = same;
+	}
+	if (common > word_len || count == 1)
+	{
+		for (int i = word_len; i < common; i++)
+		{
+			if (strchr(" \\'\"|&<>", items[0][i]) != NULL)
+				editor_insert("\\", 1);
+			editor_insert(&items[0][i], 1);
+		}
+		if (count == 1 && items[0][common - 1] != '/')
+			editor_insert(" ", 1);
+		return;
+	}
+
+	// Nothing to add, show the choices under the line
+	int pos = editor.pos;
+	editor.pos = editor.len;
+	editor_refresh();
+	write(STDOUT_FILENO, "\r\n", 2);
+	print_completions(items, count, display_offset, editor.cols, "\r\n");
+	editor.pos = pos;
+	editor.cursor_row = 0;
+}
+
+void editor_escape(char final, int param)
+{
+	/**
+	 * Handles the last byte of an ESC [ or ESC O sequence
+	 */
+	if (final != 'A' && final != 'B')
+		editor.history_pos = -1;
+
+	if (final == 'A') // up arrow
+		editor_history_move(-1);
+	else if (final == 'B') // down arrow
+	{
+		if (editor.history_pos != -1)
+			editor_history_move(1);
+	}
+	else if (final == 'C' && editor.pos < editor.len) // right arrow
+		editor.pos++;
+	else if (final == 'D' && editor.pos > editor.segment_start) // left arrow
+		editor.pos--;
+	else if (final == 'H' || (final == '~' && (param == 1 || param == 7))) // home
+		editor.pos = editor.segment_start;
+	else if (final == 'F' || (final == '~' && (param == 4 || param == 8))) // end
+		editor.pos = editor.len;
+	else if (final == '~' && param == 3) // delete
+		editor_delete(editor.pos, editor.pos + 1);
+}
+
+int line_edit(const char *prompt, char *line, int size)
+{
+	/**
+	 * Reads one command line, possibly continued over several lines with a trailing backslash
+	 * Input is consumed in blocks and the line is redrawn once per block, so pastes stay fast
+	 * @return length of line, -1 on Ctrl+D at an empty line
+	 */
+	fflush(stdout);
+	terminal_raw();
+	struct winsize window;
+	editor.cols = ioctl(STDOUT_FILENO, TIOCGWINSZ, &window) == 0 && window.ws_col > 0 ? window.ws_col : 80;
+	editor_set_prompt(prompt);
+	editor.len = editor.pos = editor.segment_start = 0;
+	editor.cursor_row = 0;
+	editor.history_pos = -1;
+	editor.searching = false;
+	editor_refresh();
+
+	int escape_state = 0, escape_param = 0;
+	while (1)
+	{
+		char input[LINE_SIZE];
+		int nbytes = editor.pending_len;
+		memcpy(input, editor.pending, nbytes);
+		editor.pending_len = 0;
+		if (nbytes == 0)
+			nbytes = read(STDIN_FILENO, input, sizeof(input));
+		if (nbytes == -1 && errno == EINTR)
+			continue;
+		if (nbytes <= 0)
+			return -1;
+
+		for (int i = 0; i < nbytes; i++)
+		{
+			char c = input[i];
+			if (editor.searching && escape_state == 0 && editor_search_key(c))
+				continue;
+			if (escape_state == 1) // after ESC
+			{
+				escape_state = c == '[' || c == 'O' ? 2 : 0;
+				escape_param = 0;
+				continue;
+			}
+			if (escape_state == 2)
+			{
+				if (c >= '0' && c <= '9')
+				{
+					escape_param = escape_param * 10 + c - '0';
+					continue;
+				}
+				escape_state = 0;
+				editor_escape(c, escape_param);
+				continue;
+			}
+
+			if (c != 27)
+				editor.history_pos = -1;
+
+			if (c == 27)
+				escape_state = 1;
+			else if (c == 18) // Ctrl+R
+			{
+				history_sync();
+				editor_save_line();
+				editor.searching = true;
+				editor.query_len = 0;
+				editor.match = -1;
+				editor_search_update(history_total() - 1);
+			}
+			else if (c == '\r' || c == '\n') // enter
+			{
+				if (c == '\r' && i + 1 < nbytes && input[i + 1] == '\n')
+					i++;
+				int backslashes = 0;
+				while (backslashes < editor.len - editor.segment_start && editor.buf[editor.len - 1 - backslashes] == '\\')
+					backslashes++;
+				editor.pos = editor.len;
+				editor_refresh();
+				write(STDOUT_FILENO, "\r\n", 2);
+				if (backslashes % 2 == 1) // escaped newline, keep reading
+				{
+					editor.len--;
+					editor.pos = editor.segment_start = editor.len;
+					editor_set_prompt("> ");
+					editor.cursor_row = 0;
+					continue;
+				}
+				// Keep what was typed ahead for the next line
+				editor.pending_len = nbytes - i - 1;
+				memcpy(editor.pending, input + i + 1, editor.pending_len);
+				int len = editor.len < size - 1 ? editor.len : size - 1;
+				memcpy(line, editor.buf, len);
+				line[len] = 0;
+				return len;
+			}
+			else if (c == 9) // handle tab
+				editor_complete();
+			else if (c == 127 || c == 8) // backspace
+				editor_delete(editor.pos - 1, editor.pos);
+			else if (c == 1) // Ctrl+A
+				editor.pos = editor.segment_start;
+			else if (c == 5) // Ctrl+E
+				editor.pos = editor.len;
+			else if (c == 2 && editor.pos > editor.segment_start) // Ctrl+B
+				editor.pos--;
+			else if (c == 6 && editor.pos < editor.len) // Ctrl+F
+				editor.pos++;
+			else if (c == 11) // Ctrl+K
+				editor_delete(editor.pos, editor.len);
+			else if (c == 21) // Ctrl+U
+				editor_delete(editor.segment_start, editor.pos);
+			else if (c == 23) // Ctrl+W, delete the word before the cursor
+			{
+				int start = editor.pos;
+				while (start > editor.segment_start && editor.buf[start - 1] == ' ')
+					start--;
+				while (start > editor.segment_start && editor.buf[start - 1] != ' ')
+					start--;
+				editor_delete(start, editor.pos);
+			}
+			else if (c == 12) // Ctrl+L
+			{
+				write(STDOUT_FILENO, "\x1b[H\x1b[2J", 7);
+				editor.cursor_row = 0;
+			}
+			else if (c == 3) // Ctrl+C, drop the line
+			{
+				editor.pos = editor.len;
+				editor_refresh();
+				write(STDOUT_FILENO, "^C\r\n", 4);
+				editor_set_prompt(prompt);
+				editor.len = editor.pos = editor.segment_start = 0;
+				editor.cursor_row = 0;
+			}
+			else if (c == 4) // Ctrl+D
+			{
+				if (editor.len == 0)
+					return -1;
+				editor_delete(editor.pos, editor.pos + 1);
+			}
+			else if ((unsigned char)c >= 32)
+			{
+				// Insert the whole run of printable bytes at once
+				int run = 1;
+				while (i + run < nbytes && (unsigned char)input[i + run] >= 32 && input[i + run] != 127)
+					run++;
+				editor_insert(input + i, run);
+				i += run - 1;
+			}
+		}
+		editor_refresh();
+	}
+}
+
+/**
+ * Prompt a command from the user
+ * @param  buf      [description]
+ * @param  buf_size [description]
+ * @return          [description]
+ */
+int prompt(struct command_t *command)
+{
+	char buf[LINE_SIZE], prompt_text[2048];
+	long long started = profile_begin();
+	show_prompt(prompt_text, sizeof(prompt_text));
+
+	int len = line_edit(prompt_text, buf, sizeof(buf));
+	if (len == -1) // Ctrl+D
+		return EXIT;
+
+	history_add(buf);
+	profile_end(PROFILE_PROMPT, started, NULL);
+
+	started = profile_begin();
+	parse_command(buf, command);
+	profile_end(PROFILE_PARSE, started, command->name);
+
+	// print_command(command); // DEBUG: uncomment for debugging
+	return SUCCESS;
+}
+
+int process_command(struct command_t *command);
+
+// Helper methods
+void save_directory();
+void flush_directory_history();
+void dir_db_load();
+unsigned int hash_string(const char *str);
+struct builtin_t *find_builtin(const char *name);
+int register_builtin(const char *name, builtin_handler handler, int min_args, int max_args, const char *usage);
+void register_builtins();
+void update_records(int record);
+int make_directories(const char *path);
+int get_record();
+char *resolve_command(const char *name);
+void hash_remove(const char *name);
+void hash_clear();
+pid_t spawn_process(const char *path, char *const argv[], char *const redirects[REDIRECT_COUNT], int in_fd, int out_fd, pid_t pgid);
+int run_process(const char *path, char *const argv[], char *const redirects[REDIRECT_COUNT]);
+void sigchld_handler(int sig);
+void job_notify();
+int run_script(int fd, const char *text);
+int file_search(struct command_t *command);
+int best_content_kernel();
+
+int main(int argc, char *argv[])
+{
+	profiler.epoch = profile_now();
+	char *profile_env = getenv("SHELLFYRE_PROFILE");
+	if (profile_env != NULL && *profile_env && strcmp(profile_env, "0") != 0)
+	{
+		profiler.enabled = true;
+		int len = strlen(profile_env);
+		if (len > 5 && strcmp(profile_env + len - 5, ".json") == 0)
+			profiler.trace_file = strdup(profile_env);
+		else
+			profiler.summary = true;
+	}
+
+	command_history = home_file("cmdhist.txt");
+	file_index = home_file("fsindex");
+	register_builtins();
+	// Prompt only when no script was given and a terminal is attached
+	bool batch = argc > 1 || !isatty(STDIN_FILENO);
+	shell_interactive = !batch && tcgetpgrp(STDIN_FILENO) == getpgrp();
+	if (shell_interactive) // signals from the keyboard are for the foreground job
+		for (int i = 0; i < (int)(sizeof(job_signals) / sizeof(job_signals[0])); i++)
+			signal(job_signals[i], SIG_IGN);
+
+	sigemptyset(&sigchld_mask);
+	sigaddset(&sigchld_mask, SIGCHLD);
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = sigchld_handler;
+	action.sa_flags = SA_RESTART;
+	sigaction(SIGCHLD, &action, NULL);
+
+	if (getenv("SHELLFYRE_SPAWN") != NULL && strcmp(getenv("SHELLFYRE_SPAWN"), "fork") == 0)
+		spawn_strategy = SPAWN_FORK;
+	content_kernel = best_content_kernel();
+	dir_db_load();
+	profile_end(PROFILE_STARTUP, profiler.enabled ? profiler.epoch : 0, sysname);
+
+	if (batch)
+	{
+		int fd = STDIN_FILENO;
+		const char *text = NULL;
+		if (argc > 1 && strcmp(argv[1], "-c") == 0)
+		{
+			if (argc < 3)
+			{
+				printf("-%s: -c: option requires an argument\n", sysname);
+				printf("Usage: %s [-c command | script]\n", sysname);
+				return 2;
+			}
+			fd = -1;
+			text = argv[2];
+		}
+		else if (argc > 1 && (fd = open(argv[1], O_RDONLY | O_CLOEXEC)) == -1)
+		{
+			printf("-%s: %s: %s\n", sysname, argv[1], strerror(errno));
+			return 127;
+		}
+		run_script(fd, text);
+		flush_directory_history();
+		profile_exit();
+		fflush(stdout);
+		return last_status;
+	}
+
+	while (1)
+	{
+		struct command_t *command = new_command();
+
+		job_notify();
+
+		int code;
+		code = prompt(command);
+		if (code == EXIT)
+			break;
+
+		long long started = profile_begin();
+		code = process_command(command);
+		profile_end(PROFILE_DISPATCH, started, command->name);
+		if (code == EXIT)
+			break;
+
+		arena_reset(&parse_arena); // frees the whole command
+	}
+
+	flush_directory_history();
+	terminal_cooked();
+	printf("\n");
+	profile_exit();
+	return last_status;
+}
+
+struct dir_entry *dir_db_find(const char *path)
+{
+	for (int i = dir_db.buckets[hash_string(path) % DIR_DB_BUCKETS]; i != -1; i = dir_db.entries[i].next)
+		if (strcmp(dir_db.entries[i].path, path) == 0)
+			return &dir_db.entries[i];
+	return NULL;
+}
+
+void dir_db_visit(const char *path, double rank, time_t time)
+{
+	/**
+	 * Adds rank to the entry of path, creating it on the first visit
+	 */
+	struct dir_entry *entry = dir_db_find(path);
+	if (entry == NULL)
+	{
+		if (dir_db.count == dir_db.capacity)
+		{
+			dir_db.capacity = dir_db.capacity ? dir_db.capacity * 2 : 256;
+			dir_db.entries = realloc(dir_db.entries, dir_db.capacity * sizeof(struct dir_entry));
+		}
+		unsigned int bucket = hash_string(path) % DIR_DB_BUCKETS;
+		entry = &dir_db.entries[dir_db.count];
+		entry->path = strdup(path);
+		entry->rank = 0;
+		entry->time = 0;
+		entry->next = dir_db.buckets[bucket];
+		dir_db.buckets[bucket] = dir_db.count++;
+	}
+	entry->rank += rank;
+	if (time > entry->time)
+		entry->time = time;
+}
+
+void dir_db_clear()
+{
+	for (int i = 0; i < dir_db.count; i++)
+		free(dir_db.entries[i].path);
+	dir_db.count = 0;
+	dir_db.log_lines = 0;
+	if (dir_db.buckets == NULL)
+		dir_db.buckets = malloc(DIR_DB_BUCKETS * sizeof(int));
+	memset(dir_db.buckets, -1, DIR_DB_BUCKETS * sizeof(int));
+}
+
+void dir_db_read(int fd)
+{
+	/**
+	 * Replaces the database with the records of fd, lines are rank|time|path
+	 * Plain path lines of the old history format count as one visit
+	 */
+	dir_db_clear();
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_size == 0)
+		return;
+	char *text = malloc(st.st_size + 1);
+	ssize_t len = pread(fd, text, st.st_size, 0);
+	text[len > 0 ? len : 0] = 0;
+
+	for (char *save, *line = strtok_r(text, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save))
+	{
+		double rank = 1;
+		long long time = st.st_mtime;
+		int path_start = 0;
+		if (line[0] != '/' && sscanf(line, "%lf|%lld|%n", &rank, &time, &path_start) < 2)
+			continue;
+		if (line[path_start] == '/')
+			dir_db_visit(line + path_start, rank, time);
+		dir_db.log_lines++;
+	}
+	free(text);
+}
+
+void dir_db_load()
+{
+	dir_db_clear();
+	int fd = open(directory_history, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return;
+	dir_db_read(fd);
+	close(fd);
+}
+
+void dir_db_compact()
+{
+	/**
+	 * Folds the visit log into one line per directory under an exclusive lock,
+	 * picking up what other shells appended, and ages the ranks like z does
+	 */
+	int fd = open(directory_history, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if (fd == -1)
+		return;
+	flock(fd, LOCK_EX);
+	dir_db_read(fd);
+
+	double total = 0;
+	for (int i = 0; i < dir_db.count; i++)
+		total += dir_db.entries[i].rank;
+	double factor = total > DIR_DB_MAX_RANK ? 0.99 : 1;
+
+	char temp[strlen(directory_history) + 8];
+	snprintf(temp, sizeof(temp), "%s.tmp", directory_history);
+	FILE *out = fopen(temp, "w");
+	if (out != NULL)
+	{
+		for (int i = 0; i < dir_db.count; i++)
+		{
+			struct dir_entry *entry = &dir_db.entries[i];
+			if (entry->rank * factor >= 1) // rarely visited directories fade out
+				fprintf(out, "%g|%lld|%s\n", entry->rank * factor, (long long)entry->time, entry->path);
+		}
+		if (fclose(out) == 0)
+			rename(temp, directory_history);
+	}
+	// Reload what was written, aging dropped some entries
+	int compacted = open(directory_history, O_RDONLY | O_CLOEXEC);
+	if (compacted != -1)
+	{
+		dir_db_read(compacted);
+		close(compacted);
+	}
+	flock(fd, LOCK_UN);
+	close(fd);
+}
+
+double frecency(struct dir_entry *entry, time_t now)
+{
+	time_t age = now - entry->time;
+	if (age < 3600)
+		return entry->rank * 4;
+	if (age < 86400)
+		return entry->rank * 2;
+	if (age < 604800)
+		return entry->rank / 2;
+	return entry->rank / 4;
+}
+
+bool dir_matches(const char *path, char *const terms[], int term_count, int level)
+{
+	/**
+	 * Terms must appear in path in order
+	 * level 0 compares exactly, 1 ignores case, 2 lets each term's letters be spread out
+	 */
+	const char *pos = path;
+	for (int t = 0; t < term_count; t++)
+	{
+		const char *term = terms[t];
+		if (level == 0)
+			pos = strstr(pos, term);
+		else if (level == 1)
+			pos = strcasestr(pos, term);
+		else
+		{
+			for (; *term && *pos; pos++)
+				if (tolower((unsigned char)*pos) == tolower((unsigned char)*term))
+					term++;
+			if (*term)
+				pos = NULL;
+		}
+		if (pos == NULL)
+			return false;
+		if (level < 2)
+			pos += strlen(term);
+	}
+	return true;
+}
+
+int compare_dir_scores(const void *a, const void *b)
+{
+	double x = ((const struct dir_match *)a)->score, y = ((const struct dir_match *)b)->score;
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+int rank_directories(char *const terms[], int term_count, struct dir_match *matches, int max)
+{
+	/**
+	 * Fills matches with existing directories matching terms, best first
+	 * Uses the strictest match level that finds anything
+	 * @return number of matches
+	 */
+	char cwd[PATH_MAX];
+	if (getcwd(cwd, sizeof(cwd)) == NULL)
+		cwd[0] = 0;
+	time_t now = time(NULL);
+	struct dir_match *all = malloc((dir_db.count + 1) * sizeof(struct dir_match));
+	int count = 0;
+	for (int level = 0; level < 3 && count == 0; level++)
+	{
+		for (int i = 0; i < dir_db.count; i++)
+		{
+			struct dir_entry *entry = &dir_db.entries[i];
+			if ((term_count > 0 && strcmp(entry->path, cwd) == 0) || !dir_matches(entry->path, terms, term_count, level))
+				continue;
+			all[count].path = entry->path;
+			all[count++].score = frecency(entry, now);
+		}
+		if (term_count == 0)
+			break;
+	}
+	qsort(all, count, sizeof(struct dir_match), compare_dir_scores);
+
+	// Directories removed since they were visited are skipped
+	int found = 0;
+	for (int i = 0; i < count && found < max; i++)
+	{
+		struct stat st;
+		if (stat(all[i].path, &st) == 0 && S_ISDIR(st.st_mode))
+			matches[found++] = all[i];
+	}
+	free(all);
+	return found;
+}
+
+void save_directory()
+{
+	/**
+	 * Counts a visit of the current working directory
+	 * Written to the file lazily, when the ring fills up or the shell exits
+	 */
+	char cwd[4096];
+	if (getcwd(cwd, sizeof(cwd)) == NULL)
+		return;
+	time_t now = time(NULL);
+	dir_db_visit(cwd, 1, now);
+	if (dir_ring_count == DIR_RING_SIZE)
+		flush_directory_history();
+	char *record = malloc(strlen(cwd) + 32);
+	sprintf(record, "1|%lld|%s", (long long)now, cwd);
+	dir_ring[(dir_ring_start + dir_ring_count++) % DIR_RING_SIZE] = record;
+}
+
+void flush_directory_history()
+{
+	/**
+	 * Appends pending visits to directory history with a single write,
+	 * compacting the file when it has grown well past the number of directories
+	 */
+	if (dir_ring_count == 0)
+		return;
+
+	size_t size = 0;
+	for (int i = 0; i < dir_ring_count; i++)
+		size += strlen(dir_ring[(dir_ring_start + i) % DIR_RING_SIZE]) + 1;
+
+	char *block = malloc(size), *end = block;
+	for (int i = 0; i < dir_ring_count; i++)
+	{
+		char *dir = dir_ring[(dir_ring_start + i) % DIR_RING_SIZE];
+		size_t len = strlen(dir);
+		memcpy(end, dir, len);
+		end[len] = '\n';
+		end += len + 1;
+		free(dir);
+	}
+	dir_db.log_lines += dir_ring_count;
+	dir_ring_start = dir_ring_count = 0;
+
+	// A compaction in another shell may replace the file between open and flock
+	int fd = -1;
+	for (int attempt = 0; attempt < 2; attempt++)
+	{
+		struct stat opened, current;
+		fd = open(directory_history, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR);
+		if (fd == -1)
+			break;
+		flock(fd, LOCK_EX);
+		if (fstat(fd, &opened) == 0 && stat(directory_history, &current) == 0 && opened.st_ino == current.st_ino)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	if (fd == -1)
+		printf("-%s: %s: %s\n", sysname, directory_history, strerror(errno));
+	else
+	{
+		if (write(fd, block, size) != (ssize_t)size)
+			printf("-%s: %s: %s\n", sysname, directory_history, strerror(errno));
+		flock(fd, LOCK_UN);
+		close(fd);
+	}
+	free(block);
+
+	if (dir_db.log_lines > dir_db.count * 2 + 64)
+		dir_db_compact();
+}
+
+int run_line(char *line)
+{
+	/**
+	 * Parses and runs one line of a script
+	 */
+	while (*line == ' ' || *line == '\t')
+		line++;
+	if (*line == '#') // comments and #! lines
+		return SUCCESS;
+	struct command_t *command = new_command();
+	int code = SUCCESS;
+	long long started = profile_begin();
+	int parsed = parse_command(line, command);
+	profile_end(PROFILE_PARSE, started, command->name);
+	if (parsed == 0)
+	{
+		started = profile_begin();
+		code = process_command(command);
+		profile_end(PROFILE_DISPATCH, started, command->name);
+	}
+	arena_reset(&parse_arena);
+	return code;
+}
+
+int run_script(int fd, const char *text)
+{
+	/**
+	 * Runs commands line by line from fd, or from text when fd is -1
+	 * Input is read in large blocks, there is no terminal setup, prompt or echo
+	 */
+	size_t capacity = SCRIPT_BLOCK_SIZE, used = 0;
+	int eof = 0, code = SUCCESS;
+	if (text != NULL)
+	{
+		used = strlen(text);
+		capacity = used > capacity ? used : capacity;
+		eof = 1;
+	}
+	char *buf = malloc(capacity + 1);
+	if (text != NULL)
+		memcpy(buf, text, used);
+
+	while (code != EXIT)
+	{
+		// Run every complete line in the buffer
+		char *line = buf, *end;
+		while (code != EXIT && (end = memchr(line, '\n', used - (line - buf))) != NULL)
+		{
+			*end = 0;
+			code = run_line(line);
+			line = end + 1;
+		}
+		used -= line - buf;
+		memmove(buf, line, used);
+
+		if (eof)
+		{
+			buf[used] = 0; // last line without a newline
+			if (used > 0 && code != EXIT)
+				code = run_line(buf);
+			break;
+		}
+		if (used == capacity) // line longer than the buffer
+		{
+			capacity *= 2;
+			buf = realloc(buf, capacity + 1);
+		}
+		ssize_t nbytes = read(fd, buf + used, capacity - used);
+		if (nbytes == -1 && errno == EINTR)
+			continue;
+		if (nbytes <= 0)
+			eof = 1;
+		else
+			used += nbytes;
+	}
+	free(buf);
+	return code;
+}
+
+void update_records(int record)
+{
+	/**
+	 * Updates records file with new record
+	 */
+	int fd = open(records, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+	if (fd == -1)
+	{
+		printf("Could not open records file.");
+		return;
+	}
+	ftruncate(fd, 0); // reset the records file
+	dprintf(fd, "%d", record);
+	close(fd);
+}
+
+int make_directories(const char *path)
+{
+	/**
+	 * mkdir -p: creates path and any missing parents
+	 */
+	char partial[4096];
+	size_t len = strlen(path);
+	if (len >= sizeof(partial))
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memcpy(partial, path, len + 1);
+
+	for (size_t i = 1; i <= len; i++)
+	{
+		if (partial[i] != '/' && partial[i] != 0)
+			continue;
+		char saved = partial[i];
+		partial[i] = 0;
+		if (mkdir(partial, 0777) == -1 && errno != EEXIST)
+			return -1;
+		partial[i] = saved;
+	}
+
+	struct stat st;
+	if (stat(path, &st) == -1)
+		return -1;
+	if (!S_ISDIR(st.st_mode))
+	{
+		errno = ENOTDIR;
+		return -1;
+	}
+	return 0;
+}
+
+int get_record()
+{
+	/**
+	 * Return current hotandcold record
+	 */
+	int record;
+	FILE *file = fopen(records, "r");
+	fscanf(file, "%d", &record);
+	fclose(file);
+	return record;
+}
+
+
+unsigned int hash_string(const char *str)
+{
+	/**
+	 * djb2 string hash
+	 */
+	unsigned int hash = 5381;
+	while (*str)
+		hash = hash * 33 + (unsigned char)*str++;
+	return hash;
+}
+
+int is_executable(const char *path)
+{
+	/**
+	 * Returns 1 if path is a regular file we are allowed to execute
+	 */
+	struct stat st;
+	if (stat(path, &st) == -1 || !S_ISREG(st.st_mode))
+		return 0;
+	return access(path, X_OK) == 0;
+}
+
+void hash_clear()
+{
+	/**
+	 * Forgets every remembered command location
+	 */
+	for (int i = 0; i < COMMAND_HASH_SIZE; i++)
+	{
+		struct hash_entry *entry = command_hash[i];
+		while (entry != NULL)
+		{
+			struct hash_entry *next = entry->next;
+			free(entry->name);
+			free(entry->path);
+			free(entry);
+			entry = next;
+		}
+		command_hash[i] = NULL;
+	}
+}
+
+void hash_remove(const char *name)
+{
+	/**
+	 * Forgets the remembered location of a single command
+	 */
+	struct hash_entry **link = &command_hash[hash_string(name) % COMMAND_HASH_SIZE];
+	while (*link != NULL)
+	{
+		if (strcmp((*link)->name, name) == 0)
+		{
+			struct hash_entry *entry = *link;
+			*link = entry->next;
+			free(entry->name);
+			free(entry->path);
+			free(entry);
+			return;
+		}
+		link = &(*link)->next;
+	}
+}
+
+char *resolve_command(const char *name)
+{
+	/**
+	 * Returns the full path of a command, searching PATH on a hash miss
+	 * Returned string is owned by the hash table, NULL if not found
+	 */
+	static char direct[4096];
+	if (strchr(name, '/') != NULL) // explicit path, no search
+	{
+		if (!is_executable(name))
+			return NULL;
+		snprintf(direct, sizeof(direct), "%s", name);
+		return direct;
+	}
+
+	// PATH changed since the table was filled, old answers may be wrong
+	const char *path_env = getenv("PATH");
+	if (path_env == NULL)
+		path_env = "/usr/local/bin:/usr/bin:/bin";
+	if (hashed_path_env == NULL || strcmp(hashed_path_env, path_env) != 0)
+	{
+		hash_clear();
+		free(hashed_path_env);
+		hashed_path_env = strdup(path_env);
+	}
+
+	unsigned int bucket = hash_string(name) % COMMAND_HASH_SIZE;
+	for (struct hash_entry *entry = command_hash[bucket]; entry != NULL; entry = entry->next)
+	{
+		if (strcmp(entry->name, name) == 0)
+		{
+			entry->hits++;
+			return entry->path;
+		}
+	}
+
+	// Walk PATH entries in order, first executable match wins
+	char candidate[4096];
+	const char *dir = path_env;
+	while (1)
+	{
+		const char *end = strchr(dir, ':');
+		int dirlen = end ? end - dir : (int)strlen(dir);
+		if (dirlen == 0) // empty entry means current directory
+			snprintf(candidate, sizeof(candidate), "./%s", name);
+		else
+			snprintf(candidate, sizeof(candidate), "%.*s/%s", dirlen, dir, name);
+
+		if (is_executable(candidate))
+		{
+			struct hash_entry *entry = malloc(sizeof(struct hash_entry));
+			entry->name = strdup(name);
+			entry->path = strdup(candidate);
+			entry->hits = 1;
+			entry->next = command_hash[bucket];
+			command_hash[bucket] = entry;
+			return entry->path;
+		}
+		if (end == NULL)
+			break;
+		dir = end + 1;
+	}
+	return NULL;
+}
+
+const int redirect_targets[REDIRECT_COUNT] = {STDIN_FILENO, STDOUT_FILENO, STDOUT_FILENO, STDERR_FILENO, STDOUT_FILENO};
+
+int spawn_open_flags(int redirect_index)
+{
+	/**
+	 * open() flags for each slot of command_t::redirects
+	 */
+	if (redirect_index == 0) // <
+		return O_RDONLY;
+	if (redirect_index == 2) // >>
+		return O_WRONLY | O_CREAT | O_APPEND;
+	return O_WRONLY | O_CREAT | O_TRUNC; // >, 2>, &>
+}
+
+void restore_redirects(int saved[3])
+{
+	/**
+	 * Puts back the stdin, stdout and stderr apply_redirects replaced
+	 */
+	fflush(stdout);
+	for (int fd = 0; fd < 3; fd++)
+	{
+		if (saved[fd] == -1)
+			continue;
+		dup2(saved[fd], fd);
+		close(saved[fd]);
+		saved[fd] = -1;
+	}
+}
+
+int apply_redirects(char *const redirects[REDIRECT_COUNT], int saved[3])
+{
+	/**
+	 * Points stdin, stdout and stderr at the redirect targets, for a builtin the shell runs itself
+	 * saved gets copies of the replaced ones for restore_redirects, -1 where nothing changed
+	 * Returns -1 after reporting a file that cannot be opened, with everything restored
+	 */
+	saved[0] = saved[1] = saved[2] = -1;
+	fflush(stdout); // what the shell printed so far belongs to the old stdout
+	for (int i = 0; i < REDIRECT_COUNT; i++)
+	{
+		if (redirects[i] == NULL)
+			continue;
+		int fd = open(redirects[i], spawn_open_flags(i) | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+		if (fd == -1)
+		{
+			int err = errno;
+			restore_redirects(saved);
+			printf("-%s: %s: %s\n", sysname, redirects[i], strerror(err));
+			return -1;
+		}
+		int target = redirect_targets[i];
+		if (saved[target] == -1)
+			saved[target] = fcntl(target, F_DUPFD_CLOEXEC, 10);
+		dup2(fd, target);
+		close(fd);
+		if (i == 4) // &> sends stderr along
+		{
+			if (saved[STDERR_FILENO] == -1)
+				saved[STDERR_FILENO] = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 10);
+			dup2(STDOUT_FILENO, STDERR_FILENO);
+		}
+	}
+	return 0;
+}
+
+void reset_child_signals()
+{
+	/**
+	 * Undoes the shell's signal setup in a forked child
+	 */
+	for (int i = 0; i < (int)(sizeof(job_signals) / sizeof(job_signals[0])); i++)
+		signal(job_signals[i], SIG_DFL);
+	sigprocmask(SIG_UNBLOCK, &sigchld_mask, NULL);
+}
+
+void job_update(pid_t pid, int status)
+{
+	/**
+	 * Records a wait status in the job owning pid, called from the SIGCHLD handler
+	 */
+	for (int j = 0; j < MAX_JOBS; j++)
+	{
+		struct job_t *job = &jobs[j];
+		if (job->id == 0)
+			continue;
+		for (int i = 0; i < job->proc_count; i++)
+		{
+			if (job->pids[i] != pid)
+				continue;
+			if (WIFSTOPPED(status))
+			{
+				if (!job->stopped[i])
+					job->stop_count++;
+				job->stopped[i] = true;
+			}
+			else if (WIFCONTINUED(status))
+			{
+				if (job->stopped[i])
+					job->stop_count--;
+				job->stopped[i] = false;
+			}
+			else // exited or killed
+			{
+				if (job->stopped[i])
+					job->stop_count--;
+				job->stopped[i] = false;
+				job->statuses[i] = status;
+				job->live--;
+			}
+			return;
+		}
+	}
+}
+
+void sigchld_handler(int sig)
+{
+	/**
+	 * Reaps every child that changed state without blocking
+	 * Children we do not track are reaped too, so no zombies pile up
+	 */
+	int saved_errno = errno;
+	int status;
+	pid_t pid;
+	while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)) > 0)
+		job_update(pid, status);
+	errno = saved_errno;
+}
+
+struct job_t *job_create(const char *cmdline, bool background)
+{
+	/**
+	 * Takes a free job slot, SIGCHLD must be blocked
+	 */
+	int id = 1;
+	struct job_t *slot = NULL;
+	for (int j = 0; j < MAX_JOBS; j++)
+	{
+		if (jobs[j].id == 0 && slot == NULL)
+			slot = &jobs[j];
+		else if (jobs[j].id >= id)
+			id = jobs[j].id + 1;
+	}
+	if (slot == NULL)
+	{
+		printf("-%s: too many jobs\n", sysname);
+		return NULL;
+	}
+	memset(slot, 0, sizeof(struct job_t));
+	slot->id = id;
+	slot->background = background;
+	snprintf(slot->cmdline, sizeof(slot->cmdline), "%s", cmdline);
+	return slot;
+}
+
+void job_add_process(struct job_t *job, pid_t pid)
+{
+	/**
+	 * Tracks a started process, the first one leads the process group
+	 */
+	if (job->proc_count == MAX_JOB_PROCS)
+		return; // still reaped by the handler, just not waited for
+	if (job->pgid == 0 && shell_interactive)
+	{
+		job->pgid = pid;
+		if (!job->background) // hand over the terminal before it is read
+			tcsetpgrp(STDIN_FILENO, pid);
+	}
+	job->pids[job->proc_count++] = pid;
+	job->live++;
+}
+
+pid_t job_pgid(struct job_t *job)
+{
+	/**
+	 * Process group argument for the next process of job, see spawn_process
+	 */
+	if (!shell_interactive)
+		return -1;
+	return job->pgid;
+}
+
+void job_signal(struct job_t *job, int sig)
+{
+	if (job->pgid > 0)
+		kill(-job->pgid, sig);
+	else
+		for (int i = 0; i < job->proc_count; i++)
+			kill(job->pids[i], sig);
+}
+
+int job_wait(struct job_t *job)
+{
+	/**
+	 * Waits in the foreground until every process of job exited or stopped
+	 * SIGCHLD must be blocked, a finished job is released
+	 * Returns the wait status of the last process
+	 */
+	long long started = profile_begin();
+	terminal_cooked();
+	if (shell_interactive && job->pgid > 0)
+	{
+		tcsetpgrp(STDIN_FILENO, job->pgid);
+		// Stopped by SIGTTIN while racing us for the terminal, it is theirs now
+		if (job->stop_count > 0)
+			job_signal(job, SIGCONT);
+	}
+
+	sigset_t wait_mask;
+	sigprocmask(SIG_BLOCK, NULL, &wait_mask);
+	sigdelset(&wait_mask, SIGCHLD);
+	while (job->live > 0 && job->stop_count < job->live)
+		sigsuspend(&wait_mask);
+
+	if (shell_interactive && job->pgid > 0)
+		tcsetpgrp(STDIN_FILENO, getpgrp());
+	profile_end(PROFILE_WAIT, started, job->cmdline);
+
+	if (job->live > 0) // stopped, keep it around for fg/bg
+	{
+		job->background = true;
+		printf("\n[%d]+  Stopped                 %s\n", job->id, job->cmdline);
+		return W_STOPCODE(SIGTSTP);
+	}
+	int status = job->proc_count > 0 ? job->statuses[job->proc_count - 1] : 0;
+	if (WIFSIGNALED(status) && WTERMSIG(status) == SIGINT)
+		printf("\n");
+	job->id = 0;
+	return status;
+}
+
+int job_finish(struct job_t *job)
+{
+	/**
+	 * Waits for a foreground job or reports a background one, then unblocks SIGCHLD
+	 */
+	int status = 0;
+	if (job->proc_count == 0)
+		job->id = 0; // nothing started
+	else if (job->background)
+		printf("[%d] %d\n", job->id, job->pgid > 0 ? job->pgid : job->pids[0]);
+	else
+		status = job_wait(job);
+	sigprocmask(SIG_UNBLOCK, &sigchld_mask, NULL);
+	return status;
+}
+
+pid_t job_fork(struct job_t *job)
+{
+	/**
+	 * Forks a copy of the shell as the next process of job, SIGCHLD must be blocked
+	 */
+	fflush(stdout);
+	pid_t pgid = job_pgid(job);
+	long long started = profile_begin();
+	pid_t pid = fork();
+	if (pid == 0) // child
+	{
+		if (pgid != -1)
+			setpgid(0, pgid);
+		reset_child_signals();
+		profiler.enabled = false; // the shell keeps the numbers
+		return 0;
+	}
+	profile_end(PROFILE_SPAWN, started, job->cmdline);
+	if (pid == -1)
+	{
+		printf("-%s: fork: %s\n", sysname, strerror(errno));
+		return -1;
+	}
+	if (pgid != -1)
+		setpgid(pid, pgid == 0 ? pid : pgid);
+	job_add_process(job, pid);
+	return pid;
+}
+
+void job_notify()
+{
+	/**
+	 * Reports and releases background jobs that finished since the last prompt
+	 */
+	sigprocmask(SIG_BLOCK, &sigchld_mask, NULL);
+	for (int j = 0; j < MAX_JOBS; j++)
+	{
+		if (jobs[j].id != 0 && jobs[j].background && jobs[j].live == 0)
+		{
+			printf("[%d]+  Done                    %s\n", jobs[j].id, jobs[j].cmdline);
+			jobs[j].id = 0;
+		}
+	}
+	sigprocmask(SIG_UNBLOCK, &sigchld_mask, NULL);
+}
+
+struct job_t *find_job(struct command_t *command)
+{
+	/**
+	 * Job named by the first argument (%n, n or a pid), the newest one without arguments
+	 */
+	struct job_t *found = NULL;
+	if (command->arg_count == 0)
+	{
+		for (int j = 0; j < MAX_JOBS; j++)
+			if (jobs[j].id != 0 && (found == NULL || jobs[j].id > found->id))
+				found = &jobs[j];
+		return found;
+	}
+
+	const char *arg = command->args[0];
+	int is_job_id = arg[0] == '%';
+	int number = atoi(is_job_id ? arg + 1 : arg);
+	for (int j = 0; j < MAX_JOBS; j++)
+	{
+		if (jobs[j].id == 0)
+			continue;
+		if (jobs[j].id == number && (is_job_id || number < MAX_JOBS))
+			return &jobs[j];
+		for (int i = 0; !is_job_id && i < jobs[j].proc_count; i++)
+			if (jobs[j].pids[i] == number)
+				return &jobs[j];
+	}
+	return NULL;
+}
+
+void describe_command(struct command_t *command, char *buf, size_t size)
+{
+	/**
+	 * Rebuilds a command line for job listings
+	 */
+	size_t len = 0;
+	buf[0] = 0;
+	for (struct command_t *stage = command; stage != NULL && len < size; stage = stage->next)
+	{
+		len += snprintf(buf + len, size - len, "%s%s", stage == command ? "" : " | ", stage->name);
+		for (int i = 0; i < stage->arg_count && len < size; i++)
+			len += snprintf(buf + len, size - len, " %s", stage->args[i]);
+	}
+	if (command->background && len < size)
+		snprintf(buf + len, size - len, " &");
+}
+
+pid_t spawn_process(const char *path, char *const argv[], char *const redirects[REDIRECT_COUNT], int in_fd, int out_fd, pid_t pgid)
+{
+	/**
+	 * Starts path with argv without waiting for it
+	 * in_fd/out_fd replace stdin/stdout when not -1, redirects are applied after them
+	 * pgid: -1 stays in the shell's group, 0 starts a new group, otherwise joins pgid
+	 * Returns the child pid, or -1 with errno set
+	 * A redirect target that cannot be opened is reported here, naming the file, and leaves errno 0
+	 */
+	const int *targets = redirect_targets;
+	fflush(stdout); // our output comes first, and a forked child must not flush it again
+	long long started = profile_begin();
+
+	if (spawn_strategy == SPAWN_POSIX)
+	{
+		posix_spawnattr_t attr;
+		posix_spawnattr_init(&attr);
+		sigset_t defaults, empty;
+		sigemptyset(&defaults);
+		for (int i = 0; i < (int)(sizeof(job_signals) / sizeof(job_signals[0])); i++)
+			sigaddset(&defaults, job_signals[i]); // ignored by the shell, not by its children
+		sigemptyset(&empty);
+		posix_spawnattr_setsigdefault(&attr, &defaults);
+		posix_spawnattr_setsigmask(&attr, &empty);
+		short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+		if (pgid != -1)
+		{
+			posix_spawnattr_setpgroup(&attr, pgid);
+			flags |= POSIX_SPAWN_SETPGROUP;
+		}
+		posix_spawnattr_setflags(&attr, flags);
+
+		// Redirects are opened here, so a missing file is not mistaken for a failed exec
+		int redirect_fds[REDIRECT_COUNT];
+		for (int i = 0; i < REDIRECT_COUNT; i++)
+			redirect_fds[i] = -1;
+		for (int i = 0; redirects != NULL && i < REDIRECT_COUNT; i++)
+		{
+			if (redirects[i] == NULL)
+				continue;
+			redirect_fds[i] = open(redirects[i], spawn_open_flags(i) | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+			if (redirect_fds[i] == -1)
+			{
+				printf("-%s: %s: %s\n", sysname, redirects[i], strerror(errno));
+				for (int j = 0; j < i; j++)
+					if (redirect_fds[j] != -1)
+						close(redirect_fds[j]);
+				posix_spawnattr_destroy(&attr);
+				errno = 0;
+				return -1;
+			}
+		}
+
+		posix_spawn_file_actions_t actions;
+		posix_spawn_file_actions_init(&actions);
+		if (in_fd != -1)
+			posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+		if (out_fd != -1)
+			posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+		for (int i = 0; redirects != NULL && i < REDIRECT_COUNT; i++)
+		{
+			if (redirects[i] == NULL)
+				continue;
+			posix_spawn_file_actions_adddup2(&actions, redirect_fds[i], targets[i]);
+			if (i == 4) // &> sends stderr along
+				posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+		}
+
+		pid_t pid;
+		int r = posix_spawn(&pid, path, &actions, &attr, argv, environ);
+		posix_spawn_file_actions_destroy(&actions);
+		posix_spawnattr_destroy(&attr);
+		for (int i = 0; i < REDIRECT_COUNT; i++)
+			if (redirect_fds[i] != -1)
+				close(redirect_fds[i]);
+		if (r == 0)
+		{
+			profile_end(PROFILE_SPAWN, started, argv[0]);
+			return pid;
+		}
+		// Exec errors are final, anything else falls back to fork
+		if (r == ENOENT || r == EACCES || r == ENOEXEC || r == ENOTDIR)
+		{
+			errno = r;
+			return -1;
+		}
+	}
+
+	// A failed exec sends its errno back over a pipe that closes on a successful one
+	int exec_error[2];
+	if (pipe2(exec_error, O_CLOEXEC) == -1)
+		return -1;
+	pid_t pid = fork();
+	if (pid == 0) // child
+	{
+		reset_child_signals();
+		close(exec_error[0]);
+		if (pgid != -1)
+			setpgid(0, pgid);
+		if (in_fd != -1)
+			dup2(in_fd, STDIN_FILENO);
+		if (out_fd != -1)
+			dup2(out_fd, STDOUT_FILENO);
+		for (int i = 0; redirects != NULL && i < REDIRECT_COUNT; i++)
+		{
+			if (redirects[i] == NULL)
+				continue;
+			int fd = open(redirects[i], spawn_open_flags(i), S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+			if (fd == -1)
+			{
+				printf("-%s: %s: %s\n", sysname, redirects[i], strerror(errno));
+				exit(1);
+			}
+			dup2(fd, targets[i]);
+			close(fd);
+			if (i == 4) // &> sends stderr along
+				dup2(STDOUT_FILENO, STDERR_FILENO);
+		}
+		execv(path, argv);
+		int err = errno;
+		write(exec_error[1], &err, sizeof(err));
+		_exit(err == ENOENT ? 127 : 126);
+	}
+	close(exec_error[1]);
+	int err;
+	if (pid > 0 && read(exec_error[0], &err, sizeof(err)) == sizeof(err))
+	{
+		close(exec_error[0]);
+		waitpid(pid, NULL, 0); // SIGCHLD is blocked by every caller, the job table never saw it
+		errno = err;
+		return -1;
+	}
+	close(exec_error[0]);
+	if (pid > 0 && pgid != -1)
+		setpgid(pid, pgid == 0 ? pid : pgid); // also from the parent, whoever runs first wins
+	profile_end(PROFILE_SPAWN, started, argv[0]);
+	return pid;
+}
+
+int run_process(const char *path, char *const argv[], char *const redirects[REDIRECT_COUNT])
+{
+	/**
+	 * Spawns a helper process in the shell's process group and waits for it to finish
+	 */
+	sigprocmask(SIG_BLOCK, &sigchld_mask, NULL);
+	struct job_t *job = job_create(argv[0], false);
+	if (job == NULL)
+	{
+		sigprocmask(SIG_UNBLOCK, &sigchld_mask, NULL);
+		return -1;
+	}
+	pid_t pid = spawn_process(path, argv, redirects, -1, -1, -1);
+	if (pid == -1)
+		printf("-%s: %s: %s\n", sysname, argv[0], strerror(errno));
+	else // tracked without a process group of its own
+	{
+		job->pids[job->proc_count++] = pid;
+		job->live++;
+	}
+	int status = job_finish(job);
+	return pid == -1 ? -1 : status;
+}
+
+long long elapsed_ns(struct timespec *start)
+{
+	/**
+	 * Nanoseconds passed since start on the monotonic clock
+	 */
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000000LL + (now.tv_nsec - start->tv_nsec);
+}
+
+int bench_spawn(int count)
+{
+	/**
+	 * Measures launch+wait latency of /bin/true for every spawn strategy
+	 */
+	const char *names[2] = {"posix_spawn", "fork"};
+	char *trueArgs[2] = {"true", NULL};
+	int saved = spawn_strategy;
+
+	for (int strategy = SPAWN_POSIX; strategy <= SPAWN_FORK; strategy++)
+	{
+		spawn_strategy = strategy;
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (int i = 0; i < count; i++)
+			if (run_process("/bin/true", trueArgs, NULL) == -1)
+				break;
+		long long total = elapsed_ns(&start);
+		printf("%-12s %d launches, %.1f ms total, %.2f us/launch\n",
+			   names[strategy], count, total / 1e6, total / 1e3 / count);
+	}
+	spawn_strategy = saved;
+	return SUCCESS;
+}
+
+int is_builtin(const char *name)
+{
+	return find_builtin(name) != NULL;
+}
+
+void relay_stage(int in_fd, int out_fd, int file_fd)
+{
+	/**
+	 * Copies in_fd to out_fd (and file_fd for tee) inside the kernel with splice()/tee()
+	 * Falls back to read/write when an end is not a pipe
+	 */
+	char buf[RELAY_CHUNK];
+	bool zero_copy = true;
+	while (1)
+	{
+		ssize_t n;
+		if (zero_copy)
+		{
+			if (file_fd == -1)
+				n = splice(in_fd, NULL, out_fd, NULL, RELAY_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+			else
+				n = tee(in_fd, out_fd, RELAY_CHUNK, 0); // duplicate, then consume into the file
+			if (n > 0 && file_fd != -1)
+			{
+				ssize_t left = n;
+				while (left > 0)
+				{
+					ssize_t moved = splice(in_fd, NULL, file_fd, NULL, left, SPLICE_F_MOVE);
+					if (moved <= 0)
+						break;
+					left -= moved;
+				}
+			}
+			if (n == -1 && errno == EINVAL) // not a pipe on one end
+			{
+				zero_copy = false;
+				continue;
+			}
+		}
+		else
+		{
+			n = read(in_fd, buf, sizeof(buf));
+			if (n > 0)
+			{
+				if (write(out_fd, buf, n) != n)
+					break;
+				if (file_fd != -1 && write(file_fd, buf, n) != n)
+					break;
+			}
+		}
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+	}
+}
+
+int is_relay_stage(struct command_t *stage)
+{
+	/**
+	 * A stage the shell can copy itself: plain cat, or tee with a single file
+	 */
+	if (!pipeline_zero_copy)
+		return 0;
+	for (int i = 0; i < REDIRECT_COUNT; i++)
+		if (stage->redirects[i] != NULL)
+			return 0;
+	if (strcmp(stage->name, "cat") == 0)
+		return stage->arg_count == 0;
+	if (strcmp(stage->name, "tee") == 0)
+		return stage->arg_count == 1 || (stage->arg_count == 2 && strcmp(stage->args[0], "-a") == 0);
+	return 0;
+}
+
+pid_t launch_stage(struct command_t *stage, int in_fd, int out_fd, struct job_t *job, int pipes[][2], int pipe_count)
+{
+	/**
+	 * Starts one pipeline stage as the next process of job
+	 */
+	int is_relay = is_relay_stage(stage);
+	if (!is_relay && !is_builtin(stage->name))
+	{
+		char *path = resolve_command(stage->name);
+		if (path == NULL)
+		{
+			printf("-%s: %s: command not found\n", sysname, stage->name);
+			last_status = 127;
+			errno = ENOENT;
+			return -1;
+		}
+		char *argv[stage->arg_count + 2];
+		argv[0] = stage->name;
+		for (int i = 0; i < stage->arg_count; i++)
+			argv[i + 1] = stage->args[i];
+		argv[stage->arg_count + 1] = NULL;
+
+		pid_t pid = spawn_process(path, argv, stage->redirects, in_fd, out_fd, job_pgid(job));
+		if (pid == -1 && errno == 0) // a redirect failed, already reported
+		{
+			last_status = 1;
+			return -1;
+		}
+		if (pid == -1)
+		{
+			last_status = errno == ENOENT ? 127 : 126;
+			printf("-%s: %s: %s\n", sysname, stage->name, strerror(errno));
+			if (errno == ENOENT) // hashed binary vanished, search PATH again next time
+				hash_remove(stage->name);
+		}
+		else
+			job_add_process(job, pid);
+		return pid;
+	}
+
+	// Stages the shell runs itself need a copy of the shell, not an exec
+	pid_t pid = job_fork(job);
+	if (pid == 0) // child
+	{
+		if (in_fd != -1)
+			dup2(in_fd, STDIN_FILENO);
+		if (out_fd != -1)
+			dup2(out_fd, STDOUT_FILENO);
+		for (int i = 0; i < pipe_count; i++) // readers only see EOF once every copy is closed
+		{
+			close(pipes[i][0]);
+			close(pipes[i][1]);
+		}
+
+		if (is_relay)
+		{
+			int file_fd = -1;
+			if (strcmp(stage->name, "tee") == 0)
+			{
+				int append = stage->arg_count == 2;
+				file_fd = open(stage->args[stage->arg_count - 1], spawn_open_flags(append ? 2 : 1),
+							   S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+				if (file_fd == -1)
+					printf("-%s: tee: %s\n", sysname, strerror(errno));
+			}
+			relay_stage(STDIN_FILENO, STDOUT_FILENO, file_fd);
+			exit(0);
+		}
+
+		stage->next = NULL; // run only this stage
+		stage->background = false;
+		process_command(stage); // applies the stage's redirects
+		fflush(stdout);
+		exit(last_status);
+	}
+	return pid;
+}
+
+int run_pipeline(struct command_t *command)
+{
+	/**
+	 * Runs a command_t::next chain as one job, every stage concurrently in one process group
+	 * Stage i reads pipe i-1 and writes pipe i, the shell waits for all of them
+	 * unless the line ended with &
+	 */
+	int stage_count = 0;
+	for (struct command_t *stage = command; stage != NULL; stage = stage->next)
+	{
+		stage_count++;
+		command->background |= stage->background;
+	}
+
+	int pipes[stage_count][2];
+	for (int i = 0; i < stage_count - 1; i++)
+	{
+		if (pipe2(pipes[i], O_CLOEXEC) == -1)
+		{
+			printf("-%s: pipe: %s\n", sysname, strerror(errno));
+			for (int j = 0; j < i; j++)
+			{
+				close(pipes[j][0]);
+				close(pipes[j][1]);
+			}
+			return SUCCESS;
+		}
+	}
+
+	char cmdline[256];
+	describe_command(command, cmdline, sizeof(cmdline));
+	sigprocmask(SIG_BLOCK, &sigchld_mask, NULL);
+	struct job_t *job = job_create(cmdline, command->background);
+
+	struct command_t *stage = command;
+	bool last_failed = false;
+	for (int i = 0; job != NULL && i < stage_count; i++, stage = stage->next)
+	{
+		int in_fd = i > 0 ? pipes[i - 1][0] : -1;
+		int out_fd = i < stage_count - 1 ? pipes[i][1] : -1;
+		// On failure the neighbours still run and see EOF
+		last_failed = launch_stage(stage, in_fd, out_fd, job, pipes, stage_count - 1) == -1;
+	}
+
+	for (int i = 0; i < stage_count - 1; i++)
+	{
+		close(pipes[i][0]);
+		close(pipes[i][1]);
+	}
+	if (job == NULL)
+	{
+		sigprocmask(SIG_UNBLOCK, &sigchld_mask, NULL);
+		last_status = 1;
+		return SUCCESS;
+	}
+	if (job->proc_count == 0)
+	{
+		job_finish(job);
+		return UNKNOWN;
+	}
+
+	// A last stage that failed to start keeps the status launch_stage gave it
+	bool background = job->background;
+	int status = job_finish(job);
+	if (background)
+		last_status = 0;
+	else if (!last_failed)
+		last_status = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WIFSTOPPED(status) ? 128 + WSTOPSIG(status) : WEXITSTATUS(status);
+	return SUCCESS;
+}
+
+int legacy_allocations(struct command_t *command)
+{
+	/**
+	 * malloc/realloc calls the per-field parser made for a parsed command:
+	 * the struct, its name, the initial args array, a realloc and a copy
+	 * per argument and one per redirect, for every piped stage
+	 */
+	int count = 0;
+	for (; command != NULL; command = command->next)
+	{
+		count += 3 + 2 * command->arg_count;
+		for (int i = 0; i < REDIRECT_COUNT; i++)
+			count += command->redirects[i] != NULL;
+	}
+	return count;
+}
+
+struct arena bench_arena; // stands in for parse_arena while bench parse/lex run
+
+void swap_arenas(struct arena *a, struct arena *b)
+{
+	/**
+	 * The parser always allocates from parse_arena, so the benchmarks swap in
+	 * bench_arena: resetting it must not free the running bench command
+	 */
+	struct arena tmp = *a;
+	*a = *b;
+	*b = tmp;
+}
+
+int bench_parse(int lines)
+{
+	/**
+	 * Parses representative lines and counts heap allocations per line
+	 */
+	const char *samples[] = {
+		"ls -la /tmp",
+		"cd ..",
+		"grep -rn \"TODO\" src | sort | uniq -c >counts.txt",
+		"filesearch -r -o shell",
+		"gcc -O2 -Wall -o shellfyre shellfyre.c",
+		"cat <in.txt >>out.txt &",
+		"pstraverse 1 -d",
+		"find . -name '*.c' | xargs wc -l | sort -n | tail -5",
+	};
+	int sample_count = sizeof(samples) / sizeof(samples[0]);
+	char buf[4096];
+	long long legacy = 0;
+	swap_arenas(&parse_arena, &bench_arena);
+	size_t before = parse_arena.allocations;
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < lines; i++)
+	{
+		strcpy(buf, samples[i % sample_count]); // parse_command writes into the line
+		struct command_t *command = new_command();
+		parse_command(buf, command);
+		legacy += legacy_allocations(command);
+		arena_reset(&parse_arena);
+	}
+	long long total = elapsed_ns(&start);
+
+	printf("%d lines, %.1f ns/line\n", lines, (double)total / lines);
+	printf("allocations/line before (per-field malloc): %.2f\n", (double)legacy / lines);
+	printf("allocations/line after (arena):             %.6f (%zu chunk mallocs)\n",
+		   (double)(parse_arena.allocations - before) / lines, parse_arena.allocations - before);
+	swap_arenas(&parse_arena, &bench_arena);
+	return SUCCESS;
+}
+
+int same_command(struct command_t *a, struct command_t *b)
+{
+	/**
+	 * Compares the fields both parsers fill, stage by stage
+	 */
+	for (; a != NULL && b != NULL; a = a->next, b = b->next)
+	{
+		if (strcmp(a->name, b->name) != 0 || a->arg_count != b->arg_count)
+			return 0;
+		for (int i = 0; i < a->arg_count; i++)
+			if (strcmp(a->args[i], b->args[i]) != 0)
+				return 0;
+		for (int i = 0; i < 3; i++) // the old parser has no 2> and &>
+			if ((a->redirects[i] == NULL) != (b->redirects[i] == NULL) ||
+				(a->redirects[i] != NULL && strcmp(a->redirects[i], b->redirects[i]) != 0))
+				return 0;
+	}
+	return a == b;
+}
+
+void random_line(char *buf, size_t size, unsigned int *seed)
+{
+	/**
+	 * Builds a line in the subset of the grammar the strtok parser understands:
+	 * space separated words, quotes without spaces, redirects glued to their file
+	 */
+	const char *words[] = {"ls", "grep", "-la", "src", "a.txt", "--color=auto", "x", "shellfyre.c", "/usr/bin", "-n"};
+	const char *redirects[] = {"<", ">", ">>"};
+	int word_count = sizeof(words) / sizeof(words[0]);
+	size_t len = 0;
+	int stages = 1 + rand_r(seed) % 4;
+	for (int s = 0; s < stages && len < size; s++)
+	{
+		len += snprintf(buf + len, size - len, "%s%s", s ? " | " : "", words[rand_r(seed) % word_count]);
+		int args = rand_r(seed) % 6;
+		for (int i = 0; i < args && len < size; i++)
+		{
+			const char *word = words[rand_r(seed) % word_count];
+			switch (rand_r(seed) % 6)
+			{
+			case 0:
+				len += snprintf(buf + len, size - len, " '%s'", word);
+				break;
+			case 1:
+				len += snprintf(buf + len, size - len, " \"%s\"", word);
+				break;
+			case 2:
+				len += snprintf(buf + len, size - len, " %s%s", redirects[rand_r(seed) % 3], word);
+				break;
+			default:
+				len += snprintf(buf + len, size - len, "%s%s", rand_r(seed) % 4 ? " " : " \t ", word);
+			}
+		}
+	}
+	if (rand_r(seed) % 8 == 0 && len < size)
+		snprintf(buf + len, size - len, " &");
+}
+
+int bench_lex(int lines)
+{
+	/**
+	 * Fuzzes parse_command against parse_command_strtok, then times both
+	 */
+	unsigned int seed = 304;
+	char line[1024], old_buf[1024], new_buf[1024];
+	int mismatches = 0;
+	swap_arenas(&parse_arena, &bench_arena);
+	for (int i = 0; i < lines; i++)
+	{
+		random_line(line, sizeof(line), &seed);
+		strcpy(old_buf, line);
+		strcpy(new_buf, line);
+		struct command_t *legacy = new_command();
+		struct command_t *lexed = new_command();
+		parse_command_strtok(old_buf, legacy);
+		parse_command(new_buf, lexed);
+		if (!same_command(legacy, lexed) || legacy->background != lexed->background)
+		{
+			if (mismatches++ < 3)
+			{
+				printf("mismatch on: %s\n", line);
+				print_command(legacy);
+				print_command(lexed);
+			}
+		}
+		arena_reset(&parse_arena);
+	}
+	printf("%d random lines, %d mismatches\n", lines, mismatches);
+
+	// Same lines through each parser
+	int (*parsers[2])(char *, struct command_t *) = {parse_command_strtok, parse_command};
+	const char *names[2] = {"strtok", "lexer"};
+	for (int p = 0; p < 2; p++)
+	{
+		seed = 304;
+		long long total = 0;
+		for (int i = 0; i < lines; i++)
+		{
+			random_line(line, sizeof(line), &seed);
+			struct timespec start;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			parsers[p](line, new_command());
+			total += elapsed_ns(&start);
+			arena_reset(&parse_arena);
+		}
+		printf("%-8s %.1f ns/line\n", names[p], (double)total / lines);
+	}
+	swap_arenas(&parse_arena, &bench_arena);
+	return SUCCESS;
+}
+
+bool search_ignored(struct search_t *search, const char *name, bool is_dir)
+{
+	for (int i = 0; i < search->ignore_count; i++)
+		if ((is_dir || !search->ignores[i].dir_only) && fnmatch(search->ignores[i].pattern, name, 0) == 0)
+			return true;
+	return false;
+}
+
+int search_load_ignores(struct search_t *search, const char *path)
+{
+	/**
+	 * Reads glob patterns, one per line, matched against entry names
+	 * Blank lines and lines starting with # are skipped, a trailing / matches only directories
+	 */
+	FILE *file = fopen(path, "r");
+	if (file == NULL)
+		return -1;
+	char line[1024];
+	while (fgets(line, sizeof(line), file) != NULL)
+	{
+		int len = strcspn(line, "\r\n");
+		line[len] = 0;
+		if (len == 0 || line[0] == '#')
+			continue;
+		bool dir_only = false;
+		if (len > 1 && line[len - 1] == '/')
+		{
+			line[--len] = 0;
+			dir_only = true;
+		}
+		search->ignores = realloc(search->ignores, (search->ignore_count + 1) * sizeof(struct search_ignore));
+		search->ignores[search->ignore_count].pattern = strdup(line);
+		search->ignores[search->ignore_count++].dir_only = dir_only;
+	}
+	fclose(file);
+	return 0;
+}
+
+bool search_matches(struct search_t *search, const char *name)
+{
+	if (search->mode == SEARCH_GLOB)
+		return fnmatch(search->pattern, name, 0) == 0;
+	if (search->mode == SEARCH_REGEX)
+		return regexec(&search->regex, name, 0, NULL, 0) == 0;
+	return strstr(name, search->pattern) != NULL;
+}
+
+int write_all(int fd, const void *data, size_t len)
+{
+	const char *pos = data;
+	while (len > 0)
+	{
+		ssize_t nbytes = write(fd, pos, len);
+		if (nbytes == -1 && errno == EINTR)
+			continue;
+		if (nbytes <= 0)
+			return -1;
+		pos += nbytes;
+		len -= nbytes;
+	}
+	return 0;
+}
+
+void search_flush(struct search_worker *worker)
+{
+	if (worker->output_len == 0)
+		return;
+	pthread_mutex_lock(&worker->search->output_lock);
+	write_all(STDOUT_FILENO, worker->output, worker->output_len);
+	pthread_mutex_unlock(&worker->search->output_lock);
+	worker->output_len = 0;
+}
+
+void search_cat(struct search_worker *worker, const char *path)
+{
+	/**
+	 * -o, copies the file to stdout while holding the output lock so files do not interleave
+	 */
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+	{
+		fprintf(stderr, "-%s: filesearch: %s: %s\n", sysname, path, strerror(errno));
+		return;
+	}
+	search_flush(worker);
+	struct search_t *search = worker->search;
+	pthread_mutex_lock(&search->output_lock);
+	while (1)
+	{
+		// The file never passes through our memory unless the kernel refuses both copies
+		ssize_t nbytes;
+		int method = search->copy_method;
+		if (method == COPY_FILE_RANGE)
+			nbytes = copy_file_range(fd, NULL, STDOUT_FILENO, NULL, SEARCH_COPY_CHUNK, 0);
+		else if (method == COPY_SENDFILE)
+			nbytes = sendfile(STDOUT_FILENO, fd, NULL, SEARCH_COPY_CHUNK);
+		else
+		{
+			nbytes = read(fd, worker->output, SEARCH_OUTPUT_SIZE);
+			if (nbytes > 0 && write_all(STDOUT_FILENO, worker->output, nbytes) == -1)
+				nbytes = -1;
+		}
+
+		if (nbytes == -1 && errno == EINTR)
+			continue;
+		if (nbytes == -1 && method != COPY_READ_WRITE &&
+			(errno == EINVAL || errno == EXDEV || errno == ENOSYS || errno == EBADF || errno == EOPNOTSUPP))
+		{
+			// Offsets were not moved, carry on with the next method for this and later files
+			search->copy_method = method + 1;
+			continue;
+		}
+		if (nbytes <= 0)
+			break;
+	}
+	pthread_mutex_unlock(&search->output_lock);
+	close(fd);
+}
+
+const char *scalar_find(const char *text, size_t len, const char *needle, size_t needle_len)
+{
+	/**
+	 * memchr for the first byte, then memcmp for the rest
+	 */
+	if (needle_len == 0)
+		return text;
+	if (needle_len > len)
+		return NULL;
+	const char *end = text + len - needle_len + 1; // last possible start + 1
+	const char *pos = text;
+	while ((pos = memchr(pos, needle[0], end - pos)) != NULL)
+	{
+		if (memcmp(pos + 1, needle + 1, needle_len - 1) == 0)
+			return pos;
+		pos++;
+	}
+	return NULL;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse2"))) const char *sse2_find(const char *text, size_t len, const char *needle, size_t needle_len)
+{
+	/**
+	 * Compares 16 starts at once against the first and the last byte of needle,
+	 * only starts where both match are verified
+	 */
+	if (needle_len == 0 || needle_len > len)
+		return scalar_find(text, len, needle, needle_len);
+	const __m128i first = _mm_set1_epi8(needle[0]);
+	const __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+	size_t i = 0;
+	for (; i + needle_len + 15 <= len; i += 16)
+	{
+		__m128i block_first = _mm_loadu_si128((const __m128i *)(text + i));
+		__m128i block_last = _mm_loadu_si128((const __m128i *)(text + i + needle_len - 1));
+		unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, block_first), _mm_cmpeq_epi8(last, block_last)));
+		while (mask != 0)
+		{
+			int bit = __builtin_ctz(mask);
+			if (memcmp(text + i + bit + 1, needle + 1, needle_len - 1) == 0)
+				return text + i + bit;
+			mask &= mask - 1;
+		}
+	}
+	return scalar_find(text + i, len - i, needle, needle_len);
+}
+
+__attribute__((target("avx2"))) const char *avx2_find(const char *text, size_t len, const char *needle, size_t needle_len)
+{
+	/**
+	 * sse2_find with 32 starts at once
+	 */
+	if (needle_len == 0 || needle_len > len)
+		return scalar_find(text, len, needle, needle_len);
+	const __m256i first = _mm256_set1_epi8(needle[0]);
+	const __m256i last = _mm256_set1_epi8(needle[needle_len - 1]);
+	size_t i = 0;
+	for (; i + needle_len + 31 <= len; i += 32)
+	{
+		__m256i block_first = _mm256_loadu_si256((const __m256i *)(text + i));
+		__m256i block_last = _mm256_loadu_si256((const __m256i *)(text + i + needle_len - 1));
+		unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(first, block_first), _mm256_cmpeq_epi8(last, block_last)));
+		while (mask != 0)
+		{
+			int bit = __builtin_ctz(mask);
+			if (memcmp(text + i + bit + 1, needle + 1, needle_len - 1) == 0)
+				return text + i + bit;
+			mask &= mask - 1;
+		}
+	}
+	return scalar_find(text + i, len - i, needle, needle_len);
+}
+#endif
+
+int best_content_kernel()
+{
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return KERNEL_AVX2;
+	return KERNEL_SSE2;
+#else
+	return KERNEL_SCALAR;
+#endif
+}
+
+const char *content_find(const char *text, size_t len, const char *needle, size_t needle_len)
+{
+#if defined(__x86_64__)
+	if (content_kernel == KERNEL_AVX2)
+		return avx2_find(text, len, needle, needle_len);
+	if (content_kernel == KERNEL_SSE2)
+		return sse2_find(text, len, needle, needle_len);
+#endif
+	return scalar_find(text, len, needle, needle_len);
+}
+
+void search_write(struct search_worker *worker, struct iovec *parts, int count)
+{
+	/**
+	 * Appends one output record made of parts, records never straddle two flushes
+	 */
+	size_t len = 0;
+	for (int i = 0; i < count; i++)
+		len += parts[i].iov_len;
+	if (worker->output_len + len > SEARCH_OUTPUT_SIZE)
+		search_flush(worker);
+	if (len > SEARCH_OUTPUT_SIZE) // longer than the buffer, write it directly
+	{
+		pthread_mutex_lock(&worker->search->output_lock);
+		writev(STDOUT_FILENO, parts, count);
+		pthread_mutex_unlock(&worker->search->output_lock);
+		return;
+	}
+	for (int i = 0; i < count; i++)
+	{
+		memcpy(worker->output + worker->output_len, parts[i].iov_base, parts[i].iov_len);
+		worker->output_len += parts[i].iov_len;
+	}
+}
+
+void search_content(struct search_worker *worker, const char *path)
+{
+	/**
+	 * -c, prints every line containing the content text
+	 * Small files are read into the worker's buffer, mapping them would cost more than the copy
+	 * Symbolic links are skipped like grep -r does
+	 */
+	struct search_t *search = worker->search;
+	int fd = open(path, O_RDONLY | O_NONBLOCK | O_NOFOLLOW | O_CLOEXEC); // a fifo must not block the walk
+	if (fd == -1)
+	{
+		if (errno == ELOOP)
+			return;
+		search_flush(worker);
+		fprintf(stderr, "-%s: filesearch: %s: %s\n", sysname, path, strerror(errno));
+		return;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0)
+	{
+		close(fd);
+		return;
+	}
+	char *map = MAP_FAILED;
+	size_t size = st.st_size;
+	if (size > SEARCH_SMALL_FILE)
+	{
+		map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED)
+			madvise(map, size, MADV_SEQUENTIAL);
+	}
+	else
+	{
+		ssize_t nbytes = read(fd, worker->file, SEARCH_SMALL_FILE);
+		size = nbytes > 0 ? nbytes : 0;
+	}
+	close(fd);
+	if (size > SEARCH_SMALL_FILE && map == MAP_FAILED)
+		return;
+	const char *data = map != MAP_FAILED ? map : worker->file;
+
+	const char *text = data, *end = data + size;
+	bool binary = memchr(data, 0, size < 8192 ? size : 8192) != NULL;
+	const char *found;
+	while (text < end && (found = content_find(text, end - text, search->content, search->content_len)) != NULL)
+	{
+		atomic_fetch_add(&search->matches, 1);
+		if (binary) // like grep, do not print lines of binary files
+		{
+			struct iovec parts[3] = {{"Binary file ", 12}, {(char *)path, strlen(path)}, {" matches\n", 9}};
+			search_write(worker, parts, 3);
+			break;
+		}
+		// text always starts a line, so the line of found starts after the last newline before it
+		const char *line = memrchr(text, '\n', found - text);
+		line = line ? line + 1 : text;
+		const char *line_end = memchr(found, '\n', end - found);
+		if (line_end == NULL)
+			line_end = end;
+		struct iovec parts[4] = {{(char *)path, strlen(path)}, {":", 1}, {(char *)line, line_end - line}, {"\n", 1}};
+		search_write(worker, parts, 4);
+		text = line_end + 1;
+	}
+	if (map != MAP_FAILED)
+		munmap(map, size);
+}
+
+void search_emit(struct search_worker *worker, const char *dir, int dir_len, const char *name, bool is_dir)
+{
+	/**
+	 * Prints dir/name, its contents with -o or its matching lines with -c
+	 */
+	struct search_t *search = worker->search;
+	int name_len = strlen(name);
+	if (search->open_files || search->content)
+	{
+		if (is_dir)
+			return;
+		char path[dir_len + name_len + 2];
+		snprintf(path, sizeof(path), "%.*s/%s", dir_len, dir, name);
+		if (search->content)
+			search_content(worker, path);
+		else
+		{
+			search_cat(worker, path);
+			atomic_fetch_add(&search->matches, 1);
+		}
+		return;
+	}
+
+	if (worker->output_len + dir_len + name_len + 2 > SEARCH_OUTPUT_SIZE)
+		search_flush(worker);
+	char *out = worker->output + worker->output_len;
+	memcpy(out, dir, dir_len);
+	out[dir_len] = '/';
+	memcpy(out + dir_len + 1, name, name_len);
+	out[dir_len + 1 + name_len] = '\n';
+	worker->output_len += dir_len + name_len + 2;
+	atomic_fetch_add(&search->matches, 1);
+}
+
+void search_push(struct search_worker *worker, char *path, int depth)
+{
+	struct search_t *search = worker->search;
+	pthread_mutex_lock(&worker->lock);
+	if (worker->tail == worker->capacity)
+	{
+		// Slide the live part to the front before growing
+		memmove(worker->tasks, worker->tasks + worker->head, (worker->tail - worker->head) * sizeof(struct search_task));
+		worker->tail -= worker->head;
+		worker->head = 0;
+		if (worker->tail == worker->capacity)
+		{
+			worker->capacity = worker->capacity ? worker->capacity * 2 : 64;
+			worker->tasks = realloc(worker->tasks, worker->capacity * sizeof(struct search_task));
+		}
+	}
+	worker->tasks[worker->tail].path = path;
+	worker->tasks[worker->tail++].depth = depth;
+	pthread_mutex_unlock(&worker->lock);
+
+	atomic_fetch_add(&search->pending, 1);
+	atomic_fetch_add(&search->queued, 1);
+	if (atomic_load(&search->idle) > 0)
+	{
+		pthread_mutex_lock(&search->idle_lock);
+		pthread_cond_signal(&search->idle_cond);
+		pthread_mutex_unlock(&search->idle_lock);
+	}
+}
+
+bool search_take(struct search_worker *worker, struct search_task *task)
+{
+	/**
+	 * Pops the newest task of this worker, or steals the oldest task of another one
+	 */
+	struct search_t *search = worker->search;
+	for (int i = 0; i < search->thread_count; i++)
+	{
+		struct search_worker *victim = &search->workers[(worker->id + i) % search->thread_count];
+		pthread_mutex_lock(&victim->lock);
+		if (victim->head < victim->tail)
+		{
+			*task = victim == worker ? victim->tasks[--victim->tail] : victim->tasks[victim->head++];
+			pthread_mutex_unlock(&victim->lock);
+			atomic_fetch_sub(&search->queued, 1);
+			return true;
+		}
+		pthread_mutex_unlock(&victim->lock);
+	}
+	return false;
+}
+
+void search_directory(struct search_worker *worker, struct search_task *task)
+{
+	struct search_t *search = worker->search;
+	int fd = open(task->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd == -1)
+	{
+		search_flush(worker);
+		fprintf(stderr, "-%s: filesearch: %s: %s\n", sysname, task->path, strerror(errno));
+		return;
+	}
+
+	int path_len = strlen(task->path);
+	if (path_len == 1 && task->path[0] == '/') // entries of / are joined without a second slash
+		path_len = 0;
+	ssize_t nbytes;
+	while ((nbytes = getdents64(fd, worker->dents, SEARCH_DENTS_SIZE)) > 0)
+	{
+		for (ssize_t offset = 0; offset < nbytes;)
+		{
+			struct dirent64 *entry = (struct dirent64 *)(worker->dents + offset);
+			offset += entry->d_reclen;
+			const char *name = entry->d_name;
+			if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+				continue;
+
+			bool is_dir = entry->d_type == DT_DIR;
+			if (entry->d_type == DT_UNKNOWN) // some filesystems do not fill d_type
+			{
+				struct stat st;
+				is_dir = fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+			}
+			if (search->ignore_count && search_ignored(search, name, is_dir))
+				continue;
+
+			bool descend = is_dir && (search->max_depth == -1 || task->depth + 1 < search->max_depth);
+			bool match = search_matches(search, name);
+			if (!match && !descend)
+				continue;
+
+			if (match)
+				search_emit(worker, task->path, path_len, name, is_dir);
+
+			int name_len = strlen(name);
+			if (descend)
+			{
+				char *path = malloc(path_len + name_len + 2);
+				memcpy(path, task->path, path_len);
+				path[path_len] = '/';
+				memcpy(path + path_len + 1, name, name_len + 1);
+				search_push(worker, path, task->depth + 1);
+			}
+		}
+	}
+	close(fd);
+	search_flush(worker); // results stream out one directory at a time
+}
+
+void *search_worker_main(void *arg)
+{
+	struct search_worker *worker = arg;
+	struct search_t *search = worker->search;
+	struct search_task task;
+	while (1)
+	{
+		if (search_take(worker, &task))
+		{
+			search_directory(worker, &task);
+			free(task.path);
+			if (atomic_fetch_sub(&search->pending, 1) == 1) // last directory, wake everyone up to exit
+			{
+				pthread_mutex_lock(&search->idle_lock);
+				pthread_cond_broadcast(&search->idle_cond);
+				pthread_mutex_unlock(&search->idle_lock);
+			}
+			continue;
+		}
+
+		pthread_mutex_lock(&search->idle_lock);
+		atomic_fetch_add(&search->idle, 1);
+		while (atomic_load(&search->queued) == 0 && atomic_load(&search->pending) > 0)
+			pthread_cond_wait(&search->idle_cond, &search->idle_lock);
+		atomic_fetch_sub(&search->idle, 1);
+		pthread_mutex_unlock(&search->idle_lock);
+		if (atomic_load(&search->pending) == 0)
+			break;
+	}
+	return NULL;
+}
+
+void index_add(struct file_index_builder *builder, const char *path, bool is_dir)
+{
+	/**
+	 * Records a path relative to the root, in the base while building and in the delta log afterwards
+	 */
+	int len = strlen(path);
+	if (builder->ready)
+	{
+		// Drop any older copy first so a path seen by a scan and an event is listed once
+		char record[2 * len + 16];
+		int record_len = snprintf(record, sizeof(record), "-- %s\n+%c %s\n", path, is_dir ? 'd' : 'f', path);
+		if (builder->delta_fd != -1)
+			write(builder->delta_fd, record, record_len);
+		builder->delta_records += 2;
+		return;
+	}
+
+	if (builder->paths_len + len + 1 > builder->paths_capacity)
+	{
+		builder->paths_capacity = (builder->paths_capacity + len + 1) * 2;
+		builder->paths = realloc(builder->paths, builder->paths_capacity);
+	}
+	if (builder->count == builder->capacity)
+	{
+		builder->capacity = builder->capacity ? builder->capacity * 2 : 4096;
+		builder->entries = realloc(builder->entries, builder->capacity * sizeof(struct file_index_entry));
+	}
+	const char *slash = strrchr(path, '/');
+	struct file_index_entry *entry = &builder->entries[builder->count++];
+	entry->path = builder->paths_len;
+	entry->name = slash ? slash + 1 - path : 0;
+	entry->is_dir = is_dir;
+	memcpy(builder->paths + builder->paths_len, path, len + 1);
+	builder->paths_len += len + 1;
+}
+
+void index_remove(struct file_index_builder *builder, const char *path)
+{
+	/**
+	 * Logs the removal of path and everything below it
+	 */
+	char record[strlen(path) + 5];
+	int record_len = snprintf(record, sizeof(record), "-- %s\n", path);
+	if (builder->delta_fd != -1)
+		write(builder->delta_fd, record, record_len);
+	builder->delta_records++;
+
+	// A directory moved elsewhere keeps its watches, they come back if it is moved into the tree
+	int len = strlen(path);
+	for (int wd = 0; wd < builder->watch_capacity; wd++)
+	{
+		char *watched = builder->watch_paths[wd];
+		if (watched && strncmp(watched, path, len) == 0 && (watched[len] == 0 || watched[len] == '/'))
+			inotify_rm_watch(builder->inotify_fd, wd);
+	}
+}
+
+void index_unwatched(struct file_index_builder *builder, const char *path)
+{
+	/**
+	 * Logs a directory inotify could not watch, changes below it are never seen
+	 * so queries list it live instead of trusting the index
+	 */
+	if (builder->ready)
+	{
+		if (builder->delta_fd != -1)
+			dprintf(builder->delta_fd, "?d %s\n", path);
+		return;
+	}
+	if (builder->unwatched_count == builder->unwatched_capacity)
+	{
+		builder->unwatched_capacity = builder->unwatched_capacity ? builder->unwatched_capacity * 2 : 16;
+		builder->unwatched = realloc(builder->unwatched, builder->unwatched_capacity * sizeof(char *));
+	}
+	builder->unwatched[builder->unwatched_count++] = strdup(path);
+}
+
+void index_scan(struct file_index_builder *builder, const char *path)
+{
+	/**
+	 * Adds everything below path and watches each directory on the way
+	 */
+	char full[PATH_MAX];
+	snprintf(full, sizeof(full), "%s/%s", builder->root, path);
+	int fd = open(full, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd == -1)
+		return;
+
+	int wd = inotify_add_watch(builder->inotify_fd, full, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW);
+	if (wd == -1 && path[0] == 0) // nothing could be trusted, queries scan live once the watcher is gone
+	{
+		fprintf(stderr, "-%s: filesearch: %s: %s\n", sysname, full, strerror(errno));
+		exit(1);
+	}
+	if (wd == -1) // ENOSPC past max_user_watches, say
+		index_unwatched(builder, path);
+	if (wd >= 0)
+	{
+		if (wd >= builder->watch_capacity)
+		{
+			int capacity = wd * 2 + 64;
+			builder->watch_paths = realloc(builder->watch_paths, capacity * sizeof(char *));
+			memset(builder->watch_paths + builder->watch_capacity, 0, (capacity - builder->watch_capacity) * sizeof(char *));
+			builder->watch_capacity = capacity;
+		}
+		free(builder->watch_paths[wd]);
+		builder->watch_paths[wd] = strdup(path);
+	}
+
+	char *dents = malloc(SEARCH_DENTS_SIZE);
+	int path_len = strlen(path);
+	ssize_t nbytes;
+	while ((nbytes = getdents64(fd, dents, SEARCH_DENTS_SIZE)) > 0)
+	{
+		for (ssize_t offset = 0; offset < nbytes;)
+		{
+			struct dirent64 *entry = (struct dirent64 *)(dents + offset);
+			offset += entry->d_reclen;
+			const char *name = entry->d_name;
+			if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+				continue;
+
+			bool is_dir = entry->d_type == DT_DIR;
+			if (entry->d_type == DT_UNKNOWN)
+			{
+				struct stat st;
+				is_dir = fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+			}
+			char child[path_len + strlen(name) + 2];
+			snprintf(child, sizeof(child), "%s%s%s", path, path_len ? "/" : "", name);
+			index_add(builder, child, is_dir);
+			if (is_dir)
+				index_scan(builder, child);
+		}
+	}
+	free(dents);
+	close(fd);
+}
+
+int compare_u64(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+	return x < y ? -1 : x > y;
+}
+
+void search_run(struct search_t *search)
+{
+	/**
+	 * Lists the directories pushed so far and everything below them, the calling thread is worker 0
+	 */
+	for (int w = 1; w < search->thread_count; w++)
+		pthread_create(&search->workers[w].thread, NULL, search_worker_main, &search->workers[w]);
+	search_worker_main(&search->workers[0]);
+	for (int w = 1; w < search->thread_count; w++)
+		pthread_join(search->workers[w].thread, NULL);
+}
+
+int index_write(struct file_index_builder *builder)
+{
+	/**
+	 * Writes the base index and renames it over file_index, after starting an empty delta log
+	 * of the next generation, so readers never pair a base with the wrong log
+	 */
+	// Trigram and entry id pairs, sorted to become the posting lists
+	size_t pair_count = 0, pair_capacity = builder->count * 8 + 64;
+	unsigned long long *pairs = malloc(pair_capacity * sizeof(unsigned long long));
+	for (unsigned int i = 0; i < builder->count; i++)
+	{
+		const unsigned char *name = (unsigned char *)builder->paths + builder->entries[i].path + builder->entries[i].name;
+		for (int j = 0; name[j] && name[j + 1] && name[j + 2]; j++)
+		{
+			if (pair_count == pair_capacity)
+			{
+				pair_capacity *= 2;
+				pairs = realloc(pairs, pair_capacity * sizeof(unsigned long long));
+			}
+			unsigned long long trigram = name[j] << 16 | name[j + 1] << 8 | name[j + 2];
+			pairs[pair_count++] = trigram << 32 | i;
+		}
+	}
+	qsort(pairs, pair_count, sizeof(unsigned long long), compare_u64);
+
+	struct file_index_trigram *trigrams = malloc((pair_count + 1) * sizeof(struct file_index_trigram));
+	unsigned int *postings = malloc((pair_count + 1) * sizeof(unsigned int));
+	unsigned int trigram_count = 0, posting_count = 0;
+	for (size_t i = 0; i < pair_count; i++)
+	{
+		if (i > 0 && pairs[i] == pairs[i - 1]) // same trigram twice in a name
+			continue;
+		unsigned int trigram = pairs[i] >> 32;
+		if (trigram_count == 0 || trigrams[trigram_count - 1].trigram != trigram)
+		{
+			trigrams[trigram_count].trigram = trigram;
+			trigrams[trigram_count].start = posting_count;
+			trigrams[trigram_count++].count = 0;
+		}
+		postings[posting_count++] = (unsigned int)pairs[i];
+		trigrams[trigram_count - 1].count++;
+	}
+	free(pairs);
+
+	struct file_index_header header;
+	memset(&header, 0, sizeof(header));
+	header.magic = FILE_INDEX_MAGIC;
+	header.generation = ++builder->generation;
+	header.watcher = getpid();
+	header.entry_count = builder->count;
+	header.trigram_count = trigram_count;
+	header.root_len = strlen(builder->root);
+	header.entries_offset = (sizeof(header) + header.root_len + 1 + 7) & ~7ULL;
+	header.trigrams_offset = header.entries_offset + builder->count * sizeof(struct file_index_entry);
+	header.postings_offset = header.trigrams_offset + trigram_count * sizeof(struct file_index_trigram);
+	header.paths_offset = header.postings_offset + posting_count * sizeof(unsigned int);
+	header.size = header.paths_offset + builder->paths_len;
+
+	char base[strlen(file_index) + 16], temp[strlen(file_index) + 16], delta[strlen(file_index) + 16];
+	snprintf(base, sizeof(base), "%s.new", file_index);
+	snprintf(temp, sizeof(temp), "%s.tmp", file_index);
+	snprintf(delta, sizeof(delta), "%s.delta", file_index);
+	int status = -1;
+	int fd = open(base, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd != -1)
+	{
+		char padding[8] = {0};
+		status = write_all(fd, &header, sizeof(header)) | write_all(fd, builder->root, header.root_len + 1) |
+				 write_all(fd, padding, header.entries_offset - sizeof(header) - header.root_len - 1) |
+				 write_all(fd, builder->entries, builder->count * sizeof(struct file_index_entry)) |
+				 write_all(fd, trigrams, trigram_count * sizeof(struct file_index_trigram)) |
+				 write_all(fd, postings, posting_count * sizeof(unsigned int)) |
+				 write_all(fd, builder->paths, builder->paths_len);
+		close(fd);
+	}
+	free(trigrams);
+	free(postings);
+
+	if (builder->delta_fd != -1)
+		close(builder->delta_fd);
+	builder->delta_fd = -1;
+	if (status == 0)
+	{
+		fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		status = fd == -1 ? -1 : dprintf(fd, "generation %u\n", header.generation) < 0;
+		if (fd != -1)
+			close(fd);
+	}
+	if (status == 0)
+		status = rename(temp, delta) | rename(base, file_index);
+	if (status != 0)
+	{
+		fprintf(stderr, "-%s: filesearch: %s: %s\n", sysname, file_index, strerror(errno));
+		return -1;
+	}
+	builder->delta_fd = open(delta, O_WRONLY | O_APPEND | O_CLOEXEC);
+	builder->delta_records = 0;
+	return 0;
+}
+
+void index_rebuild(struct file_index_builder *builder)
+{
+	builder->ready = false;
+	builder->count = 0;
+	builder->paths_len = 0;
+	for (int i = 0; i < builder->unwatched_count; i++)
+		free(builder->unwatched[i]);
+	builder->unwatched_count = 0;
+	index_scan(builder, "");
+	index_write(builder);
+	builder->ready = true;
+	for (int i = 0; i < builder->unwatched_count; i++) // into the new delta log
+		index_unwatched(builder, builder->unwatched[i]);
+}
+
+int index_daemon(const char *directory)
+{
+	/**
+	 * filesearch -I, indexes directory and follows its changes until the shell exits
+	 */
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+	char root[PATH_MAX];
+	if (realpath(directory, root) == NULL)
+	{
+		fprintf(stderr, "-%s: filesearch: %s: %s\n", sysname, directory, strerror(errno));
+		return 1;
+	}
+	if (strcmp(root, "/") == 0)
+		root[0] = 0;
+
+	struct file_index_builder *builder = calloc(1, sizeof(struct file_index_builder));
+	builder->root = root;
+	builder->delta_fd = -1;
+	builder->inotify_fd = inotify_init1(IN_CLOEXEC);
+	if (builder->inotify_fd == -1)
+	{
+		fprintf(stderr, "-%s: filesearch: inotify: %s\n", sysname, strerror(errno));
+		return 1;
+	}
+
+	// Continue the generation of an older index so its readers notice the change
+	int fd = open(file_index, O_RDONLY | O_CLOEXEC);
+	if (fd != -1)
+	{
+		struct file_index_header old;
+		if (read(fd, &old, sizeof(old)) == sizeof(old) && old.magic == FILE_INDEX_MAGIC)
+			builder->generation = old.generation;
+		close(fd);
+	}
+
+	index_rebuild(builder);
+	char events[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t nbytes;
+	while ((nbytes = read(builder->inotify_fd, events, sizeof(events))) > 0 || (nbytes == -1 && errno == EINTR))
+	{
+		bool overflow = false;
+		for (ssize_t offset = 0; offset < nbytes;)
+		{
+			struct inotify_event *event = (struct inotify_event *)(events + offset);
+			offset += sizeof(struct inotify_event) + event->len;
+			if (event->mask & IN_Q_OVERFLOW)
+			{
+				overflow = true;
+				continue;
+			}
+			if (event->wd < 0 || event->wd >= builder->watch_capacity || builder->watch_paths[event->wd] == NULL)
+				continue;
+			if (event->mask & IN_IGNORED)
+			{
+				free(builder->watch_paths[event->wd]);
+				builder->watch_paths[event->wd] = NULL;
+				continue;
+			}
+			if (event->len == 0)
+				continue;
+
+			const char *parent = builder->watch_paths[event->wd];
+			char path[strlen(parent) + event->len + 2];
+			snprintf(path, sizeof(path), "%s%s%s", parent, parent[0] ? "/" : "", event->name);
+			if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+				index_remove(builder, path);
+			if (event->mask & (IN_CREATE | IN_MOVED_TO))
+			{
+				index_add(builder, path, event->mask & IN_ISDIR);
+				if (event->mask & IN_ISDIR)
+					index_scan(builder, path);
+			}
+		}
+		if (overflow || builder->delta_records > FILE_INDEX_COMPACT + (int)(builder->count / 8))
+			index_rebuild(builder);
+	}
+	return 0;
+}
+
+int index_lookup(int *table, int table_size, struct index_change *changes, const char *path, int len)
+{
+	/**
+	 * @return index of the change hashed for path, -1 if none
+	 */
+	unsigned int hash = 5381;
+	for (int i = 0; i < len; i++)
+		hash = hash * 33 + (unsigned char)path[i];
+	for (unsigned int slot = hash & (table_size - 1);; slot = (slot + 1) & (table_size - 1))
+	{
+		int change = table[slot];
+		if (change == -1 || (changes[change].len == len && memcmp(changes[change].path, path, len) == 0))
+			return change;
+	}
+}
+
+void index_insert(int *table, int table_size, struct index_change *changes, int change)
+{
+	unsigned int hash = 5381;
+	for (int i = 0; i < changes[change].len; i++)
+		hash = hash * 33 + (unsigned char)changes[change].path[i];
+	unsigned int slot = hash & (table_size - 1);
+	while (table[slot] != -1 && !(changes[table[slot]].len == changes[change].len &&
+								  memcmp(changes[table[slot]].path, changes[change].path, changes[change].len) == 0))
+		slot = (slot + 1) & (table_size - 1);
+	table[slot] = change;
+}
+
+int index_load_delta(struct index_delta *delta, unsigned int generation)
+{
+	/**
+	 * Reads file_index.delta
+	 * @return -1 if it belongs to another generation of the index
+	 */
+	char path[strlen(file_index) + 16];
+	snprintf(path, sizeof(path), "%s.delta", file_index);
+	memset(delta, 0, sizeof(*delta));
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1)
+	{
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+	delta->text = malloc(st.st_size + 1);
+	ssize_t len = read(fd, delta->text, st.st_size);
+	close(fd);
+	if (len < 0)
+		len = 0;
+	delta->text[len] = 0;
+
+	unsigned int delta_generation;
+	if (sscanf(delta->text, "generation %u", &delta_generation) != 1 || delta_generation != generation)
+		return -1;
+
+	int capacity = 0;
+	for (char *line = strchr(delta->text, '\n'); line != NULL && line[1] != 0;)
+	{
+		line++;
+		char *end = strchr(line, '\n');
+		if (end == NULL) // still being written
+			break;
+		*end = 0;
+		if (end - line > 3)
+		{
+			if (delta->count == capacity)
+			{
+				capacity = capacity ? capacity * 2 : 64;
+				delta->changes = realloc(delta->changes, capacity * sizeof(struct index_change));
+			}
+			struct index_change *change = &delta->changes[delta->count++];
+			change->path = line + 3;
+			change->len = end - line - 3;
+			change->removed = line[0] == '-';
+			change->is_dir = line[1] == 'd';
+			change->unwatched = line[0] == '?';
+			delta->unwatched_count += change->unwatched;
+		}
+		line = end;
+	}
+
+	delta->table_size = 16;
+	while (delta->table_size < delta->count * 2)
+		delta->table_size *= 2;
+	delta->removals = malloc(delta->table_size * sizeof(int));
+	delta->additions = malloc(delta->table_size * sizeof(int));
+	delta->unwatched = malloc(delta->table_size * sizeof(int));
+	memset(delta->removals, -1, delta->table_size * sizeof(int));
+	memset(delta->additions, -1, delta->table_size * sizeof(int));
+	memset(delta->unwatched, -1, delta->table_size * sizeof(int));
+	for (int i = 0; i < delta->count; i++)
+	{
+		struct index_change *change = &delta->changes[i];
+		index_insert(change->unwatched ? delta->unwatched : change->removed ? delta->removals : delta->additions,
+					 delta->table_size, delta->changes, i);
+	}
+	return 0;
+}
+
+bool index_removed_after(struct index_delta *delta, const char *path, int change)
+{
+	/**
+	 * Checks whether path or one of its parents was removed after change, -1 for the base
+	 */
+	if (delta->count == 0)
+		return false;
+	int len = strlen(path);
+	for (int i = 1; i <= len; i++)
+	{
+		if (i < len && path[i] != '/')
+			continue;
+		int removal = index_lookup(delta->removals, delta->table_size, delta->changes, path, i);
+		if (removal > change)
+			return true;
+	}
+	return false;
+}
+
+bool index_under_unwatched(struct index_delta *delta, const char *path, bool inclusive)
+{
+	/**
+	 * Checks whether path lies below a directory the daemon could not watch, or is one when inclusive
+	 */
+	if (delta->unwatched_count == 0)
+		return false;
+	int len = strlen(path);
+	for (int i = 1; i <= len; i++)
+	{
+		if (i < len ? path[i] != '/' : !inclusive)
+			continue;
+		int change = index_lookup(delta->unwatched, delta->table_size, delta->changes, path, i);
+		if (change != -1 && !index_removed_after(delta, delta->changes[change].path, change))
+			return true;
+	}
+	return false;
+}
+
+bool index_ignored(struct search_t *search, const char *rest, bool is_dir)
+{
+	/**
+	 * Checks every component of rest, a path relative to the searched directory, against the ignore patterns
+	 */
+	char component[PATH_MAX];
+	for (const char *start = rest; *start;)
+	{
+		int len = strcspn(start, "/");
+		snprintf(component, sizeof(component), "%.*s", len, start);
+		bool last = start[len] == 0;
+		if (search_ignored(search, component, last ? is_dir : true))
+			return true;
+		start += last ? len : len + 1;
+	}
+	return false;
+}
+
+void index_visit(struct search_t *search, const char *prefix, const char *path, int sub_len, bool is_dir)
+{
+	/**
+	 * Filters one indexed path relative to the root and prints it relative to the searched directory
+	 */
+	if (sub_len > 0 && (strncmp(path, search->index_sub, sub_len) != 0 || path[sub_len] != '/'))
+		return;
+	const char *rest = path + (sub_len > 0 ? sub_len + 1 : 0);
+	const char *name = strrchr(rest, '/');
+	name = name ? name + 1 : rest;
+	if (!search_matches(search, name))
+		return;
+
+	int depth = 1;
+	for (const char *c = rest; *c; c++)
+		depth += *c == '/';
+	if (search->max_depth != -1 && depth > search->max_depth)
+		return;
+
+	if (search->ignore_count && index_ignored(search, rest, is_dir))
+		return;
+
+	char dir[PATH_MAX];
+	int dir_len = snprintf(dir, sizeof(dir), "%s%s%.*s", prefix, name > rest ? "/" : "", (int)(name > rest ? name - rest - 1 : 0), rest);
+	search_emit(&search->workers[0], dir, dir_len, name, is_dir);
+}
+
+void index_query(struct search_t *search, char *map, struct index_delta *delta, const char *directory, const char *sub)
+{
+	/**
+	 * Prints the indexed paths below sub, the searched directory relative to the root
+	 */
+	struct file_index_header *header = (struct file_index_header *)map;
+	search->index_sub = sub;
+	int sub_len = strlen(sub);
+	int prefix_len = strlen(directory);
+	while (prefix_len > 0 && directory[prefix_len - 1] == '/')
+		prefix_len--;
+	char prefix[prefix_len + 1];
+	snprintf(prefix, sizeof(prefix), "%.*s", prefix_len, directory);
+
+	struct file_index_entry *entries = (struct file_index_entry *)(map + header->entries_offset);
+	struct file_index_trigram *trigrams = (struct file_index_trigram *)(map + header->trigrams_offset);
+	unsigned int *postings = (unsigned int *)(map + header->postings_offset);
+	const char *paths = map + header->paths_offset;
+
+	// A substring of three bytes or more only needs the shortest posting list of its trigrams
+	unsigned int *candidates = NULL;
+	unsigned int candidate_count = header->entry_count;
+	const unsigned char *pattern = (const unsigned char *)search->pattern;
+	if (search->mode == SEARCH_SUBSTRING && strlen(search->pattern) >= 3)
+	{
+		for (int j = 0; pattern[j + 2]; j++)
+		{
+			unsigned int trigram = pattern[j] << 16 | pattern[j + 1] << 8 | pattern[j + 2];
+			int low = 0, high = (int)header->trigram_count - 1, found = -1;
+			while (low <= high && found == -1)
+			{
+				int mid = (low + high) / 2;
+				if (trigrams[mid].trigram == trigram)
+					found = mid;
+				else if (trigrams[mid].trigram < trigram)
+					low = mid + 1;
+				else
+					high = mid - 1;
+			}
+			if (found == -1)
+			{
+				candidate_count = 0;
+				break;
+			}
+			if (candidates == NULL || trigrams[found].count < candidate_count)
+			{
+				candidates = postings + trigrams[found].start;
+				candidate_count = trigrams[found].count;
+			}
+		}
+	}
+
+	for (unsigned int i = 0; i < candidate_count; i++)
+	{
+		struct file_index_entry *entry = &entries[candidates ? candidates[i] : i];
+		const char *path = paths + entry->path;
+		if (!index_removed_after(delta, path, -1) && !index_under_unwatched(delta, path, false))
+			index_visit(search, prefix, path, sub_len, entry->is_dir);
+	}
+	for (int i = 0; i < delta->count; i++)
+	{
+		struct index_change *change = &delta->changes[i];
+		if (!change->removed && !change->unwatched &&
+			index_lookup(delta->additions, delta->table_size, delta->changes, change->path, change->len) == i &&
+			!index_removed_after(delta, change->path, i) && !index_under_unwatched(delta, change->path, false))
+			index_visit(search, prefix, change->path, sub_len, change->is_dir);
+	}
+	search_flush(&search->workers[0]);
+
+	// Unwatched directories below sub are listed live, each once even when nested
+	bool live = false;
+	for (int i = 0; i < delta->count; i++)
+	{
+		struct index_change *change = &delta->changes[i];
+		if (!change->unwatched || index_lookup(delta->unwatched, delta->table_size, delta->changes, change->path, change->len) != i ||
+			index_removed_after(delta, change->path, i) || index_under_unwatched(delta, change->path, false))
+			continue;
+		if (sub_len > 0 && (strncmp(change->path, sub, sub_len) != 0 || change->path[sub_len] != '/'))
+			continue;
+		const char *rest = change->path + (sub_len > 0 ? sub_len + 1 : 0);
+		int depth = 1;
+		for (const char *c = rest; *c; c++)
+			depth += *c == '/';
+		if ((search->max_depth != -1 && depth >= search->max_depth) || (search->ignore_count && index_ignored(search, rest, true)))
+			continue;
+		char *path = malloc(prefix_len + strlen(rest) + 2);
+		sprintf(path, "%s/%s", prefix, rest);
+		search_push(&search->workers[0], path, depth);
+		live = true;
+	}
+	if (live)
+		search_run(search);
+}
+
+int index_search(struct search_t *search, const char *directory)
+{
+	/**
+	 * Answers a filesearch below the indexed root from file_index
+	 * @return -1 if the index is missing, not kept current or does not cover directory
+	 */
+	char real[PATH_MAX];
+	struct stat st;
+	if (realpath(directory, real) == NULL)
+		return -1;
+	int fd = open(file_index, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct file_index_header))
+	{
+		close(fd);
+		return -1;
+	}
+	char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	struct file_index_header *header = (struct file_index_header *)map;
+	const char *root = map + sizeof(struct file_index_header);
+	struct index_delta delta;
+	memset(&delta, 0, sizeof(delta));
+	bool usable = header->magic == FILE_INDEX_MAGIC && header->size == (unsigned long long)st.st_size &&
+				  (kill(header->watcher, 0) == 0 || errno == EPERM) &&
+				  strncmp(real, root, header->root_len) == 0 && (real[header->root_len] == 0 || real[header->root_len] == '/') &&
+				  index_load_delta(&delta, header->generation) == 0;
+	const char *sub = real + header->root_len + (real[header->root_len] == '/');
+	if (usable && index_under_unwatched(&delta, sub, true)) // nothing of it is watched
+		usable = false;
+	if (usable)
+		index_query(search, map, &delta, directory, sub);
+
+	free(delta.text);
+	free(delta.changes);
+	free(delta.removals);
+	free(delta.additions);
+	free(delta.unwatched);
+	munmap(map, st.st_size);
+	return usable ? 0 : -1;
+}
+
+const char *filesearch_usage = "filesearch [-r] [-o] [-d depth] [-g | -e] [-i ignorefile] [-j threads] [-L] [-c text] pattern [directory]\n"
+								"       filesearch -I [directory]";
+
+int file_search(struct command_t *command)
+{
+	/**
+	 * filesearch [-r] [-o] [-d depth] [-g | -e] [-i ignorefile] [-j threads] [-L] [-c text] pattern [directory]
+	 * filesearch -I [directory]
+	 * Runs in the job's child process, returns the exit status
+	 */
+	if (command->arg_count > 0 && strcmp(command->args[0], "-I") == 0)
+		return index_daemon(command->arg_count > 1 ? command->args[1] : ".");
+
+	struct search_t *search = calloc(1, sizeof(struct search_t));
+	search->max_depth = 1;
+	search->thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+	const char *directory = ".";
+	const char *ignore_file = NULL;
+	int status = 0;
+
+	char *operands[2];
+	int operand_count = 0;
+	bool usage = false;
+	for (int i = 0; i < command->arg_count; i++)
+	{
+		char *option = command->args[i];
+		bool has_value = i + 1 < command->arg_count;
+		if (option[0] != '-' || option[1] == 0)
+		{
+			if (operand_count < 2)
+				operands[operand_count] = option;
+			operand_count++;
+		}
+		else if (strcmp(option, "-r") == 0)
+			search->max_depth = -1;
+		else if (strcmp(option, "-o") == 0)
+			search->open_files = true;
+		else if (strcmp(option, "-g") == 0)
+			search->mode = SEARCH_GLOB;
+		else if (strcmp(option, "-e") == 0)
+			search->mode = SEARCH_REGEX;
+		else if (strcmp(option, "-d") == 0 && has_value)
+			search->max_depth = atoi(command->args[++i]);
+		else if (strcmp(option, "-i") == 0 && has_value)
+			ignore_file = command->args[++i];
+		else if (strcmp(option, "-j") == 0 && has_value)
+			search->thread_count = atoi(command->args[++i]);
+		else if (strcmp(option, "-L") == 0)
+			search->live = true;
+		else if (strcmp(option, "-c") == 0 && has_value)
+		{
+			search->content = command->args[++i];
+			search->content_len = strlen(search->content);
+		}
+		else
+			usage = true;
+	}
+	if (usage || operand_count < 1 || operand_count > 2)
+	{
+		fprintf(stderr, "Usage: %s\n", filesearch_usage);
+		free(search);
+		return 2;
+	}
+	search->pattern = operands[0];
+	if (operand_count == 2)
+		directory = operands[1];
+	if (search->thread_count < 1)
+		search->thread_count = 1;
+	if (search->thread_count > SEARCH_MAX_THREADS)
+		search->thread_count = SEARCH_MAX_THREADS;
+	struct stat st;
+	search->copy_method = fstat(STDOUT_FILENO, &st) == 0 && S_ISREG(st.st_mode) ? COPY_FILE_RANGE : COPY_SENDFILE;
+
+	if (search->mode == SEARCH_REGEX)
+	{
+		int error = regcomp(&search->regex, search->pattern, REG_EXTENDED | REG_NOSUB);
+		if (error != 0)
+		{
+			char message[256];
+			regerror(error, &search->regex, message, sizeof(message));
+			fprintf(stderr, "-%s: filesearch: %s: %s\n", sysname, search->pattern, message);
+			free(search);
+			return 2;
+		}
+	}
+
+	// .fsignore in the searched directory applies by default
+	char default_ignore[strlen(directory) + 11];
+	snprintf(default_ignore, sizeof(default_ignore), "%s/.fsignore", directory);
+	search_load_ignores(search, default_ignore);
+	if (ignore_file != NULL && search_load_ignores(search, ignore_file) == -1)
+	{
+		fprintf(stderr, "-%s: filesearch: %s: %s\n", sysname, ignore_file, strerror(errno));
+		status = 2;
+	}
+
+	pthread_mutex_init(&search->idle_lock, NULL);
+	pthread_cond_init(&search->idle_cond, NULL);
+	pthread_mutex_init(&search->output_lock, NULL);
+	for (int w = 0; w < search->thread_count; w++)
+	{
+		struct search_worker *worker = &search->workers[w];
+		worker->id = w;
+		worker->search = search;
+		worker->dents = malloc(SEARCH_DENTS_SIZE);
+		worker->output = malloc(SEARCH_OUTPUT_SIZE);
+		worker->file = search->content ? malloc(SEARCH_SMALL_FILE) : NULL;
+		pthread_mutex_init(&worker->lock, NULL);
+	}
+
+	// Deeper searches are answered by the index when one is kept for the directory
+	if (search->max_depth == 1 || search->live || index_search(search, directory) == -1)
+	{
+		int root_len = strlen(directory);
+		while (root_len > 1 && directory[root_len - 1] == '/')
+			root_len--;
+		search_push(&search->workers[0], strndup(directory, root_len), 0);
+		search_run(search);
+	}
+
+	if (atomic_load(&search->matches) == 0 && search->open_files)
+		printf("Could not find a file.\n");
+	return status;
+}
+
+long long time_file_search(struct command_t *search)
+{
+	/**
+	 * Runs filesearch as a job with its output sent to /dev/null
+	 * @return wall time in ns
+	 */
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	sigprocmask(SIG_BLOCK, &sigchld_mask, NULL);
+	struct job_t *job = job_create("bench grep", false);
+	pid_t pid = job != NULL ? job_fork(job) : -1;
+	if (pid == 0) // child
+	{
+		int null_fd = open("/dev/null", O_WRONLY);
+		dup2(null_fd, STDOUT_FILENO);
+		exit(file_search(search));
+	}
+	if (job != NULL)
+		job_finish(job);
+	else
+		sigprocmask(SIG_UNBLOCK, &sigchld_mask, NULL);
+	return elapsed_ns(&start);
+}
+
+int bench_grep(char *text, char *directory)
+{
+	/**
+	 * Times filesearch -r -c with every kernel the CPU has against find | xargs grep -F
+	 * The tree is read once first so every run finds it in the page cache
+	 */
+	struct command_t *search = new_command();
+	search->name = "filesearch";
+	char *args[] = {"-r", "-c", text, "", directory};
+	for (int i = 0; i < 5; i++)
+		push_arg(search, args[i]);
+	int saved = content_kernel;
+	time_file_search(search);
+
+	for (int kernel = KERNEL_SCALAR; kernel <= best_content_kernel(); kernel++)
+	{
+		content_kernel = kernel;
+		printf("filesearch -c %-8s %.1f ms\n", content_kernel_names[kernel], time_file_search(search) / 1e6);
+	}
+	content_kernel = saved;
+
+	setenv("BENCH_TEXT", text, 1);
+	setenv("BENCH_DIRECTORY", directory, 1);
+	char *shellArgs[] = {"sh", "-c", "find \"$BENCH_DIRECTORY\" -type f -print0 | xargs -0 grep -F -e \"$BENCH_TEXT\" > /dev/null", NULL};
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	run_process("/bin/sh", shellArgs, NULL);
+	printf("find | xargs grep     %.1f ms\n", elapsed_ns(&start) / 1e6);
+	unsetenv("BENCH_TEXT");
+	unsetenv("BENCH_DIRECTORY");
+	return SUCCESS;
+}
+
+int open_pstraverse()
+{
+	/**
+	 * Opens the module's /proc file, there once root ran make load, and it stays until make unload
+	 * Callers fall back to /proc when it is missing or not writable
+	 */
+	return open(pstraverse_file, O_RDWR | O_CLOEXEC);
+}
+
+char *pstraverse_request(const char *request, size_t *len)
+{
+	/**
+	 * Writes one "PID mode" request and reads the whole answer into a malloc'd string
+	 * Returns NULL with errno set on failure
+	 */
+	int fd = open_pstraverse();
+	if (fd == -1)
+		return NULL;
+	size_t size = 65536;
+	char *text = malloc(size);
+	*len = 0;
+	ssize_t nbytes = write(fd, request, strlen(request));
+	while (nbytes != -1 && (nbytes = read(fd, text + *len, size - *len - 1)) > 0)
+	{
+		*len += nbytes;
+		if (size - *len < 4096)
+			text = realloc(text, size *= 2);
+	}
+	int saved = errno;
+	close(fd);
+	if (nbytes == -1)
+	{
+		free(text);
+		errno = saved;
+		return NULL;
+	}
+	text[*len] = 0;
+	return text;
+}
+
+int proc_read_stat(struct proc_task *task)
+{
+	/**
+	 * Fills task from /proc/<pid>/stat, comm is everything between the first ( and the last )
+	 */
+	char path[32], buf[1024];
+	snprintf(path, sizeof(path), "%d/stat", task->pid);
+	int fd = openat(proc_fd, path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+	ssize_t len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return -1;
+	buf[len] = 0;
+
+	char *open_paren = strchr(buf, '('), *close_paren = strrchr(buf, ')');
+	if (open_paren == NULL || close_paren == NULL || close_paren[1] == 0)
+		return -1;
+	snprintf(task->comm, sizeof(task->comm), "%.*s", (int)(close_paren - open_paren - 1), open_paren + 1);
+	int fields = sscanf(close_paren + 2, "%c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %*d %*d %*d %*d %d %*d %llu %*u %ld",
+						&task->state, &task->ppid, &task->utime, &task->stime, &task->threads, &task->start_time, &task->rss_pages);
+	return fields == 7 ? 0 : -1;
+}
+
+void *proc_scan_worker(void *arg)
+{
+	struct proc_scan *scan = arg;
+	int start;
+	while ((start = atomic_fetch_add(&scan->next, PROC_SCAN_CHUNK)) < scan->count)
+		for (int i = start; i < start + PROC_SCAN_CHUNK && i < scan->count; i++)
+			scan->tasks[i].valid = proc_read_stat(&scan->tasks[i]) == 0;
+	return NULL;
+}
+
+int compare_proc_pids(const void *a, const void *b)
+{
+	const struct proc_task *x = a, *y = b;
+	return (x->pid > y->pid) - (x->pid < y->pid);
+}
+
+int compare_proc_starts(const void *a, const void *b)
+{
+	const struct proc_task *x = *(struct proc_task *const *)a, *y = *(struct proc_task *const *)b;
+	if (x->start_time != y->start_time)
+		return x->start_time < y->start_time ? -1 : 1;
+	return (x->pid > y->pid) - (x->pid < y->pid);
+}
+
+int proc_find(struct proc_task *tasks, int count, pid_t pid)
+{
+	struct proc_task key = {.pid = pid};
+	struct proc_task *task = bsearch(&key, tasks, count, sizeof(struct proc_task), compare_proc_pids);
+	return task != NULL ? task - tasks : -1;
+}
+
+struct proc_task *proc_snapshot(int *count)
+{
+	/**
+	 * Lists the processes in /proc, reads their stat files in parallel and links each under its parent
+	 * Returns the tasks sorted by pid, NULL with errno set on failure
+	 */
+	if (proc_fd == -1)
+		proc_fd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (proc_fd == -1)
+		return NULL;
+
+	int capacity = 1024, n = 0;
+	struct proc_task *tasks = malloc(capacity * sizeof(struct proc_task));
+	char dents[SEARCH_DENTS_SIZE];
+	ssize_t nbytes;
+	lseek(proc_fd, 0, SEEK_SET);
+	while ((nbytes = getdents64(proc_fd, dents, sizeof(dents))) > 0)
+	{
+		for (ssize_t offset = 0; offset < nbytes;)
+		{
+			struct dirent64 *entry = (struct dirent64 *)(dents + offset);
+			offset += entry->d_reclen;
+			if (!isdigit((unsigned char)entry->d_name[0]))
+				continue;
+			if (n == capacity)
+				tasks = realloc(tasks, (capacity *= 2) * sizeof(struct proc_task));
+			tasks[n++].pid = atoi(entry->d_name);
+		}
+	}
+
+	struct proc_scan scan = {.tasks = tasks, .count = n};
+	atomic_init(&scan.next, 0);
+	int thread_count = n / (4 * PROC_SCAN_CHUNK) + 1; // a thread costs about as much as a few hundred stat reads
+	if (thread_count > PROC_SCAN_MAX_THREADS)
+		thread_count = PROC_SCAN_MAX_THREADS;
+	if (thread_count > sysconf(_SC_NPROCESSORS_ONLN))
+		thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_t threads[PROC_SCAN_MAX_THREADS];
+	int started = 1;
+	while (started < thread_count && pthread_create(&threads[started], NULL, proc_scan_worker, &scan) == 0)
+		started++;
+	proc_scan_worker(&scan);
+	for (int i = 1; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	int live = 0;
+	for (int i = 0; i < n; i++)
+		if (tasks[i].valid)
+			tasks[live++] = tasks[i];
+	qsort(tasks, live, sizeof(struct proc_task), compare_proc_pids);
+
+	/**
+	 * The module keeps children in fork order, start time then pid comes closest
+	 */
+	struct proc_task **by_start = malloc((live + 1) * sizeof(struct proc_task *));
+	for (int i = 0; i < live; i++)
+	{
+		tasks[i].parent = tasks[i].first_child = tasks[i].last_child = tasks[i].next_sibling = -1;
+		by_start[i] = &tasks[i];
+	}
+	qsort(by_start, live, sizeof(struct proc_task *), compare_proc_starts);
+	for (int k = 0; k < live; k++)
+	{
+		struct proc_task *task = by_start[k];
+		int parent = task->ppid != task->pid ? proc_find(tasks, live, task->ppid) : -1;
+		if (parent == -1)
+			continue;
+		int i = task - tasks;
+		task->parent = parent;
+		if (tasks[parent].last_child != -1)
+			tasks[tasks[parent].last_child].next_sibling = i;
+		else
+			tasks[parent].first_child = i;
+		tasks[parent].last_child = i;
+	}
+	free(by_start);
+	*count = live;
+	return tasks;
+}
+
+int proc_read_uid(pid_t pid)
+{
+	char path[32], buf[4096];
+	snprintf(path, sizeof(path), "%d/status", pid);
+	int fd = openat(proc_fd, path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+	ssize_t len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return -1;
+	buf[len] = 0;
+	char *line = strstr(buf, "\nUid:");
+	int uid;
+	return line != NULL && sscanf(line + 5, "%d", &uid) == 1 ? uid : -1;
+}
+
+bool proc_match(struct proc_task *task, struct pstraverse_filter *filter)
+{
+	/**
+	 * Name and state come with the snapshot, the uid costs a read of /proc/<pid>/status
+	 */
+	if (filter->comm[0] == '^' && strncmp(task->comm, filter->comm + 1, strlen(filter->comm + 1)) != 0)
+		return false;
+	if (filter->comm[0] != 0 && filter->comm[0] != '^' && strstr(task->comm, filter->comm) == NULL)
+		return false;
+	if (filter->states[0] != 0 && strchr(filter->states, task->state) == NULL)
+		return false;
+	return filter->uid == -1 || proc_read_uid(task->pid) == filter->uid;
+}
+
+bool proc_visit(struct proc_task *tasks, int i, int depth, struct pstraverse_filter *filter, bool *shown)
+{
+	/**
+	 * Marks whether i is shown and tells the walk whether to go below it, like the module's visitTask
+	 */
+	shown[i] = proc_match(&tasks[i], filter);
+	if (filter->max_depth >= 0 && depth >= filter->max_depth)
+		return false;
+	return shown[i] || !filter->prune;
+}
+
+void proc_print_threads(pid_t pid)
+{
+	/**
+	 * The threads of pid other than the leader, from /proc/<pid>/task
+	 */
+	char path[48], comm[32];
+	snprintf(path, sizeof(path), "%d/task", pid);
+	int fd = openat(proc_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	DIR *dir = fd != -1 ? fdopendir(fd) : NULL;
+	if (dir == NULL)
+	{
+		if (fd != -1)
+			close(fd);
+		return;
+	}
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL)
+	{
+		pid_t tid = atoi(entry->d_name);
+		if (tid <= 0 || tid == pid)
+			continue;
+		snprintf(path, sizeof(path), "%d/task/%d/comm", pid, tid);
+		int comm_fd = openat(proc_fd, path, O_RDONLY | O_CLOEXEC);
+		ssize_t len = comm_fd != -1 ? read(comm_fd, comm, sizeof(comm) - 1) : -1;
+		if (comm_fd != -1)
+			close(comm_fd);
+		if (len <= 0)
+			continue;
+		comm[len - (comm[len - 1] == '\n')] = 0;
+		printf("    TID: %d, Name: %s\n", tid, comm);
+	}
+	closedir(dir);
+}
+
+int proc_walk(struct proc_task *tasks, int root, bool breadth_first, struct pstraverse_filter *filter, int *order, int *depth,
+			  bool *shown, int *peak)
+{
+	/**
+	 * Fills order with every walked process and shown with the ones the filter lets through, returns how many were walked
+	 * depth is scratch space for BFS, one entry per task, so that repeated walks allocate nothing
+	 * peak is the longest the BFS queue got, or the deepest level DFS reached
+	 */
+	int n = 0;
+	order[n++] = root;
+	depth[root] = 0;
+	*peak = 0;
+	if (breadth_first) // order doubles as the queue
+	{
+		for (int head = 0; head < n; head++)
+		{
+			int i = order[head];
+			if (!proc_visit(tasks, i, depth[i], filter, shown))
+				continue;
+			for (int child = tasks[i].first_child; child != -1; child = tasks[child].next_sibling)
+			{
+				depth[child] = depth[i] + 1;
+				order[n++] = child;
+			}
+			if (n - head - 1 > *peak)
+				*peak = n - head - 1;
+		}
+	}
+	else // preorder without a stack, like the module
+	{
+		int i = root, level = 0;
+		bool descend = proc_visit(tasks, i, level, filter, shown);
+		while (1)
+		{
+			if (descend && tasks[i].first_child != -1)
+			{
+				i = tasks[i].first_child;
+				order[n++] = i;
+				descend = proc_visit(tasks, i, ++level, filter, shown);
+				if (level > *peak)
+					*peak = level;
+				continue;
+			}
+			while (i != root && tasks[i].next_sibling == -1)
+			{
+				i = tasks[i].parent;
+				level--;
+			}
+			if (i == root)
+				break;
+			i = tasks[i].next_sibling;
+			order[n++] = i;
+			descend = proc_visit(tasks, i, level, filter, shown);
+		}
+	}
+	return n;
+}
+
+int compare_usage_keys(const void *a, const void *b)
+{
+	const unsigned long long *x = a, *y = b; // key, then position
+	if (x[0] != y[0])
+		return x[0] < y[0] ? 1 : -1; // heaviest first
+	return (x[1] > y[1]) - (x[1] < y[1]);
+}
+
+int proc_traverse(pid_t pid, const char *mode, int top, const char *key, struct pstraverse_filter *filter)
+{
+	/**
+	 * The traversal and lines of /proc/pstraverse, from the /proc tree
+	 * Returns 0, or an errno for the caller to report
+	 */
+	int count;
+	struct proc_task *tasks = proc_snapshot(&count);
+	if (tasks == NULL)
+		return errno;
+	int root = proc_find(tasks, count, pid);
+	if (root == -1)
+	{
+		free(tasks);
+		return ESRCH;
+	}
+
+	int *order = malloc(count * sizeof(int)), *depth = malloc(count * sizeof(int)), peak;
+	bool *shown = malloc(count * sizeof(bool));
+	int n = proc_walk(tasks, root, strcmp(mode, "-b") == 0, filter, order, depth, shown, &peak);
+	free(depth);
+
+	if (strcmp(mode, "-a") != 0)
+	{
+		for (int k = 0; k < n; k++)
+		{
+			if (!shown[order[k]])
+				continue;
+			printf("PID: %d, Name: %s\n", tasks[order[k]].pid, tasks[order[k]].comm);
+			if (filter->threads)
+				proc_print_threads(tasks[order[k]].pid);
+		}
+		free(shown);
+		free(order);
+		free(tasks);
+		return 0;
+	}
+
+	/**
+	 * -a, subtree sums in one backwards pass over the DFS order, children come before parents
+	 */
+	struct proc_usage
+	{
+		int processes, threads;
+		long rss_pages;
+		unsigned long long utime, stime;
+	} *subtree = calloc(count, sizeof(struct proc_usage));
+	for (int k = 0; k < n; k++)
+	{
+		struct proc_task *task = &tasks[order[k]];
+		subtree[order[k]] = (struct proc_usage){1, task->threads, task->rss_pages, task->utime, task->stime};
+	}
+	for (int k = n - 1; k > 0; k--)
+	{
+		struct proc_usage *child = &subtree[order[k]], *parent = &subtree[tasks[order[k]].parent];
+		parent->processes += child->processes;
+		parent->threads += child->threads;
+		parent->rss_pages += child->rss_pages;
+		parent->utime += child->utime;
+		parent->stime += child->stime;
+	}
+	int kept = 0; // sums cover every walked process, only the shown ones are listed
+	for (int k = 0; k < n; k++)
+		if (shown[order[k]])
+			order[kept++] = order[k];
+	n = kept;
+	if (top > 0)
+	{
+		unsigned long long (*keys)[2] = malloc(n * sizeof(*keys));
+		for (int k = 0; k < n; k++)
+		{
+			struct proc_usage *usage = &subtree[order[k]];
+			keys[k][0] = strcmp(key, "rss") == 0 ? (unsigned long long)usage->rss_pages : strcmp(key, "threads") == 0 ? (unsigned long long)usage->threads : usage->utime + usage->stime;
+			keys[k][1] = k;
+		}
+		qsort(keys, n, sizeof(*keys), compare_usage_keys);
+		int *sorted = malloc(n * sizeof(int));
+		for (int k = 0; k < n; k++)
+			sorted[k] = order[keys[k][1]];
+		memcpy(order, sorted, n * sizeof(int));
+		free(sorted);
+		free(keys);
+		if (top < n)
+			n = top;
+	}
+
+	long page_kb = sysconf(_SC_PAGESIZE) / 1024, ticks = sysconf(_SC_CLK_TCK);
+	for (int k = 0; k < n; k++)
+	{
+		struct proc_task *task = &tasks[order[k]];
+		struct proc_usage *usage = &subtree[order[k]];
+		printf("PID: %d, Name: %s, State: %c, Threads: %d, RSS: %lu kB, User: %llu ms, System: %llu ms, "
+			   "Subtree: %d processes, %d threads, %lu kB, %llu ms user, %llu ms system\n",
+			   task->pid, task->comm, task->state, task->threads, task->rss_pages * page_kb,
+			   task->utime * 1000 / ticks, task->stime * 1000 / ticks, usage->processes, usage->threads,
+			   usage->rss_pages * page_kb, usage->utime * 1000 / ticks, usage->stime * 1000 / ticks);
+		if (filter->threads)
+			proc_print_threads(task->pid);
+	}
+	free(shown);
+	free(subtree);
+	free(order);
+	free(tasks);
+	return 0;
+}
+
+/**
+ * Process tree shapes for bench, node 0 is the root and every parent comes before its children
+ */
+struct tree_shape
+{
+	int count;
+	int *parent, *first_child, *next_sibling;
+	int *size; // processes in the subtree, the node included
+};
+
+int make_tree_shape(struct tree_shape *shape, const char *kind, int count)
+{
+	/**
+	 * chain, fan, random with each parent picked uniformly among the earlier nodes, or 4ary
+	 * Returns -1 for an unknown kind
+	 */
+	unsigned int seed = 1; // the same random tree every run
+	if (strcmp(kind, "chain") != 0 && strcmp(kind, "fan") != 0 && strcmp(kind, "random") != 0 && strcmp(kind, "4ary") != 0)
+		return -1;
+	shape->count = count;
+	shape->parent = malloc(count * sizeof(int));
+	shape->first_child = malloc(count * sizeof(int));
+	shape->next_sibling = malloc(count * sizeof(int));
+	shape->size = malloc(count * sizeof(int));
+	int *last_child = malloc(count * sizeof(int));
+	for (int i = 0; i < count; i++)
+	{
+		shape->first_child[i] = shape->next_sibling[i] = last_child[i] = -1;
+		shape->size[i] = 1;
+		if (i == 0)
+			shape->parent[i] = -1;
+		else if (kind[0] == 'c')
+			shape->parent[i] = i - 1;
+		else if (kind[0] == 'f')
+			shape->parent[i] = 0;
+		else if (kind[0] == 'r')
+			shape->parent[i] = rand_r(&seed) % i;
+		else
+			shape->parent[i] = (i - 1) / 4;
+		if (i == 0)
+			continue;
+		int parent = shape->parent[i];
+		if (last_child[parent] != -1)
+			shape->next_sibling[last_child[parent]] = i;
+		else
+			shape->first_child[parent] = i;
+		last_child[parent] = i;
+	}
+	for (int i = count - 1; i > 0; i--)
+		shape->size[shape->parent[i]] += shape->size[i];
+	free(last_child);
+	return 0;
+}
+
+void free_tree_shape(struct tree_shape *shape)
+{
+	free(shape->parent);
+	free(shape->first_child);
+	free(shape->next_sibling);
+	free(shape->size);
+}
+
+void fork_tree(struct tree_shape *shape, int hold_fd, int ready_fd)
+{
+	/**
+	 * Runs as node 0, every process forks its own children, writes 1 on ready_fd,
+	 * or minus the size of a subtree it could not fork, and sleeps until hold_fd is closed
+	 */
+	int node = 0, child = shape->first_child[0];
+	while (child != -1)
+	{
+		pid_t pid = fork();
+		if (pid == 0) // child, carries on as that node
+		{
+			node = child;
+			child = shape->first_child[node];
+			continue;
+		}
+		if (pid == -1)
+		{
+			int lost = -shape->size[child];
+			write(ready_fd, &lost, sizeof(lost));
+		}
+		child = shape->next_sibling[child];
+	}
+	int started = 1;
+	char byte;
+	write(ready_fd, &started, sizeof(started));
+	read(hold_fd, &byte, 1);
+	while (wait(NULL) > 0)
+		;
+	_exit(0);
+}
+
+pid_t start_tree(struct tree_shape *shape, int *hold_fd, int *started)
+{
+	/**
+	 * Forks shape and returns its root once every process is up or known lost, -1 with errno set on failure
+	 * Closing hold_fd and stop_tree() end it
+	 */
+	int hold[2], ready[2];
+	if (pipe(hold) == -1)
+		return -1;
+	if (pipe(ready) == -1)
+	{
+		close(hold[0]);
+		close(hold[1]);
+		return -1;
+	}
+	sigprocmask(SIG_BLOCK, &sigchld_mask, NULL); // reaped here, not by the job table
+	fflush(stdout);
+	pid_t root = fork();
+	if (root == 0) // child
+	{
+		reset_child_signals();
+		close(hold[1]);
+		close(ready[0]);
+		fork_tree(shape, hold[0], ready[1]);
+	}
+	close(hold[0]);
+	close(ready[1]);
+
+	int accounted = 0, values[1024]; // 4-byte writes never split, so reads return whole values
+	ssize_t nbytes;
+	*started = 0;
+	while (root != -1 && accounted < shape->count && (nbytes = read(ready[0], values, sizeof(values))) > 0)
+	{
+		for (int i = 0; i < nbytes / (int)sizeof(int); i++)
+		{
+			accounted += abs(values[i]);
+			*started += values[i] > 0 ? values[i] : 0;
+		}
+	}
+	close(ready[0]);
+	*hold_fd = hold[1];
+	if (root == -1)
+	{
+		close(hold[1]);
+		sigprocmask(SIG_UNBLOCK, &sigchld_mask, NULL);
+	}
+	return root;
+}
+
+void stop_tree(pid_t root, int hold_fd)
+{
+	close(hold_fd);
+	waitpid(root, NULL, 0);
+	sigprocmask(SIG_UNBLOCK, &sigchld_mask, NULL);
+}
+
+void print_verify(const char *when)
+{
+	size_t len;
+	char *text = pstraverse_request("0 -v\n", &len);
+	if (text == NULL)
+	{
+		printf("-%s: bench: %s: %s\n", sysname, pstraverse_file, strerror(errno));
+		return;
+	}
+	printf("%-17s%s", when, text); // mismatches first, then the summary line
+	free(text);
+}
+
+int bench_shadow(int count)
+{
+	/**
+	 * Stress test of the module's shadow tree: forks count processes and compares
+	 * the shadow tree with a walk of the task list while they run and after they exit
+	 */
+	struct tree_shape shape;
+	struct timespec start;
+	int hold_fd, started;
+	make_tree_shape(&shape, "4ary", count);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pid_t root = start_tree(&shape, &hold_fd, &started);
+	free_tree_shape(&shape);
+	if (root == -1)
+	{
+		printf("-%s: bench: %s\n", sysname, strerror(errno));
+		return SUCCESS;
+	}
+	printf("forked %d processes in %.1f ms\n", started, elapsed_ns(&start) / 1e6);
+
+	char request[64];
+	size_t len;
+	snprintf(request, sizeof(request), "%d -d\n", root);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	char *text = pstraverse_request(request, &len);
+	if (text != NULL)
+	{
+		int lines = 0;
+		for (size_t i = 0; i < len; i++)
+			lines += text[i] == '\n';
+		printf("subtree query    %d processes in %.2f ms\n", lines, elapsed_ns(&start) / 1e6);
+		free(text);
+	}
+	else
+		printf("-%s: bench: %s: %s\n", sysname, pstraverse_file, strerror(errno));
+	print_verify("while running");
+
+	stop_tree(root, hold_fd);
+	print_verify("after exit");
+	return SUCCESS;
+}
+
+void bench_proc_walks(pid_t root, int rounds)
+{
+	/**
+	 * The lines of the module's -t, timing the /proc backend's snapshot and walks instead
+	 */
+	struct timespec start;
+	int count;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	struct proc_task *tasks = proc_snapshot(&count);
+	if (tasks == NULL)
+	{
+		printf("-%s: bench: /proc: %s\n", sysname, strerror(errno));
+		return;
+	}
+	printf("snapshot: %d processes from /proc in %lld ns\n", count, elapsed_ns(&start));
+	int i = proc_find(tasks, count, root);
+	if (i == -1)
+	{
+		printf("-%s: bench: %d: %s\n", sysname, root, strerror(ESRCH));
+		free(tasks);
+		return;
+	}
+
+	struct pstraverse_filter filter = {.max_depth = -1, .uid = -1};
+	int *order = malloc(count * sizeof(int)), *depth = malloc(count * sizeof(int)), n = 0, peak = 0;
+	bool *shown = malloc(count * sizeof(bool));
+	for (int breadth_first = 1; breadth_first >= 0; breadth_first--)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (int round = 0; round < rounds; round++)
+			n = proc_walk(tasks, i, breadth_first, &filter, order, depth, shown, &peak);
+		long long ns = elapsed_ns(&start);
+		printf("%s: %d processes, %d rounds, %lld ns per round, %.0f processes/s, peak %s %d\n", breadth_first ? "BFS" : "DFS",
+			   n, rounds, ns / rounds, (double)n * rounds * 1e9 / (ns > 0 ? ns : 1), breadth_first ? "queue" : "depth", peak);
+	}
+	free(shown);
+	free(depth);
+	free(order);
+	free(tasks);
+}
+
+int bench_pstree(const char *kind, int count, int rounds)
+{
+	/**
+	 * Forks a chain, fan or random tree of count processes and times rounds of BFS and DFS over it,
+	 * in the module through /proc/pstraverse, or over the /proc backend's tree without the module
+	 */
+	struct tree_shape shape;
+	struct timespec start;
+	int hold_fd, started;
+	if (strcmp(kind, "4ary") == 0 || make_tree_shape(&shape, kind, count) != 0)
+	{
+		printf("Usage: bench pstree chain|fan|random [processes] [rounds]\n");
+		return SUCCESS;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pid_t root = start_tree(&shape, &hold_fd, &started);
+	free_tree_shape(&shape);
+	if (root == -1)
+	{
+		printf("-%s: bench: %s\n", sysname, strerror(errno));
+		return SUCCESS;
+	}
+	printf("forked %d of %d processes (%s) in %.1f ms\n", started, count, kind, elapsed_ns(&start) / 1e6);
+
+	char request[64];
+	size_t len;
+	snprintf(request, sizeof(request), "%d -t %d\n", root, rounds);
+	char *text = pstraverse_request(request, &len);
+	if (text != NULL)
+	{
+		fwrite(text, 1, len, stdout);
+		free(text);
+	}
+	else
+	{
+		printf("%s: %s, timing the /proc backend\n", pstraverse_file, strerror(errno));
+		bench_proc_walks(root, rounds);
+	}
+	stop_tree(root, hold_fd);
+	return SUCCESS;
+}
+
+struct builtin_t *find_builtin(const char *name)
+{
+	/**
+	 * Open addressing on hash_string, a miss stops at the first empty slot
+	 */
+	for (unsigned int slot = hash_string(name);; slot++)
+	{
+		struct builtin_t *builtin = &builtins[slot % BUILTIN_SLOTS];
+		if (builtin->name == NULL)
+			return NULL;
+		if (strcmp(builtin->name, name) == 0)
+			return builtin;
+	}
+}
+
+int register_builtin(const char *name, builtin_handler handler, int min_args, int max_args, const char *usage)
+{
+	/**
+	 * Adds a command run by the shell itself, replacing any builtin of the same name
+	 * min_args/max_args bound the argument count, max_args -1 for no limit
+	 * usage is printed instead of calling handler when the count is outside them
+	 */
+	if (builtin_count == BUILTIN_SLOTS / 2) // keep probes short
+		return -1;
+	struct builtin_t *builtin = find_builtin(name);
+	if (builtin == NULL)
+	{
+		unsigned int slot = hash_string(name);
+		while (builtins[slot % BUILTIN_SLOTS].name != NULL)
+			slot++;
+		builtin = &builtins[slot % BUILTIN_SLOTS];
+		builtin_count++;
+	}
+	*builtin = (struct builtin_t){name, handler, min_args, max_args, usage};
+	return 0;
+}
+
+int builtin_exit(struct command_t *command)
+{
+	/**
+	 * exit without a status keeps the last command's
+	 */
+	if (command->arg_count > 0)
+		last_status = atoi(command->args[0]) & 0xff;
+	return EXIT;
+}
+
+int process_command(struct command_t *command)
+{
+	if (strcmp(command->name, "") == 0)
+		return SUCCESS;
+
+	if (command->next != NULL)
+		return run_pipeline(command);
+
+	struct builtin_t *builtin = find_builtin(command->name);
+	if (builtin == NULL) // External command, a pipeline of one stage
+		return run_pipeline(command);
+	if (command->arg_count < builtin->min_args || (builtin->max_args != -1 && command->arg_count > builtin->max_args))
+	{
+		printf("Usage: %s\n", builtin->usage);
+		last_status = 2;
+		return SUCCESS;
+	}
+	int saved[3];
+	if (apply_redirects(command->redirects, saved) == -1)
+	{
+		last_status = 1;
+		return SUCCESS;
+	}
+	if (builtin->handler != builtin_exit)
+		last_status = 0;
+	int result = builtin->handler(command);
+	restore_redirects(saved);
+	return result;
+}
+
+int builtin_cd(struct command_t *command)
+{
+	/**
+	 * cd without a directory goes home
+	 */
+	const char *directory = command->arg_count > 0 ? command->args[0] : getenv("HOME");
+	if (directory == NULL)
+		return SUCCESS;
+	if (chdir(directory) == -1)
+		printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+	// This part is for the cdh implementation
+	else
+		save_directory();
+	return SUCCESS;
+}
+
+int builtin_hash(struct command_t *command)
+{
+	if (command->arg_count > 0 && strcmp(command->args[0], "-r") == 0)
+	{
+		hash_clear();
+		return SUCCESS;
+	}
+
+	if (command->arg_count > 0) // remember the given commands
+	{
+		for (int i = 0; i < command->arg_count; i++)
+			if (resolve_command(command->args[i]) == NULL)
+				printf("-%s: %s: %s: not found\n", sysname, command->name, command->args[i]);
+		return SUCCESS;
+	}
+
+	int empty = 1;
+	for (int i = 0; i < COMMAND_HASH_SIZE; i++)
+	{
+		for (struct hash_entry *entry = command_hash[i]; entry != NULL; entry = entry->next)
+		{
+			if (empty)
+				printf("hits\tcommand\n");
+			empty = 0;
+			printf("%4d\t%s\n", entry->hits, entry->path);
+		}
+	}
+	if (empty)
+		printf("%s: hash table empty\n", sysname);
+	return SUCCESS;
+}
+
+int builtin_jobs(struct command_t *command)
+{
+	sigprocmask(SIG_BLOCK, &sigchld_mask, NULL);
+	for (int j = 0; j < MAX_JOBS; j++)
+	{
+		struct job_t *job = &jobs[j];
+		if (job->id == 0 || !job->background)
+			continue;
+		const char *state = job->live == 0 ? "Done" : job->stop_count == job->live ? "Stopped" : "Running";
+		printf("[%d]   %-24s%s\n", job->id, state, job->cmdline);
+	}
+	sigprocmask(SIG_UNBLOCK, &sigchld_mask, NULL);
+	job_notify();
+	return SUCCESS;
+}
+
+int builtin_fg(struct command_t *command)
+{
+	sigprocmask(SIG_BLOCK, &sigchld_mask, NULL);
+	struct job_t *job = find_job(command);
+	if (job == NULL)
+	{
+		sigprocmask(SIG_UNBLOCK, &sigchld_mask, NULL);
+		printf("-%s: %s: %s: no such job\n", sysname, command->name,
+			   command->arg_count > 0 ? command->args[0] : "current");
+		return SUCCESS;
+	}
+	job->background = strcmp(command->name, "bg") == 0;
+	if (job->background)
+		printf("[%d]+ %s\n", job->id, job->cmdline);
+	else
+		printf("%s\n", job->cmdline);
+	if (!job->background && shell_interactive && job->pgid > 0)
+		tcsetpgrp(STDIN_FILENO, job->pgid); // before it runs into the terminal
+	job_signal(job, SIGCONT);
+	if (job->background)
+		sigprocmask(SIG_UNBLOCK, &sigchld_mask, NULL);
+	else
+		job_finish(job);
+	return SUCCESS;
+}
+
+int builtin_wait(struct command_t *command)
+{
+	/**
+	 * Waits for one or every background job without giving it the terminal
+	 * Every job leaves out daemons like the filesearch indexer, which never finish
+	 */
+	sigprocmask(SIG_BLOCK, &sigchld_mask, NULL);
+	struct job_t *only = NULL;
+	if (command->arg_count > 0 && (only = find_job(command)) == NULL)
+		printf("-%s: %s: %s: no such job\n", sysname, command->name, command->args[0]);
+
+	sigset_t wait_mask;
+	sigprocmask(SIG_BLOCK, NULL, &wait_mask);
+	sigdelset(&wait_mask, SIGCHLD);
+	for (int j = 0; j < MAX_JOBS; j++)
+	{
+		struct job_t *job = &jobs[j];
+		if (job->id == 0 || (only != NULL && job != only) || (only == NULL && (command->arg_count > 0 || job->daemon)))
+			continue;
+		while (job->live > 0 && job->stop_count < job->live)
+			sigsuspend(&wait_mask);
+		if (job->live == 0)
+			job->id = 0;
+	}
+	sigprocmask(SIG_UNBLOCK, &sigchld_mask, NULL);
+	return SUCCESS;
+}
+
+int builtin_zerocopy(struct command_t *command)
+{
+	if (command->arg_count > 0)
+		pipeline_zero_copy = strcmp(command->args[0], "on") == 0;
+	printf("zerocopy %s\n", pipeline_zero_copy ? "on" : "off");
+	return SUCCESS;
+}
 
-	// restore the old settings
-	tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+int builtin_profile(struct command_t *command)
+{
+	char *action = command->arg_count > 0 ? command->args[0] : "show";
+	if (strcmp(action, "on") == 0 || strcmp(action, "off") == 0)
+	{
+		profiler.enabled = strcmp(action, "on") == 0;
+		printf("profile %s\n", action);
+	}
+	else if (strcmp(action, "reset") == 0)
+	{
+		memset(profiler.buckets, 0, sizeof(profiler.buckets));
+		memset(profiler.samples, 0, sizeof(profiler.samples));
+		memset(profiler.total, 0, sizeof(profiler.total));
+		memset(profiler.max, 0, sizeof(profiler.max));
+		profiler.event_count = 0;
+		profiler.dropped = 0;
+	}
+	else if (strcmp(action, "show") == 0)
+		profile_report();
+	else if (strcmp(action, "trace") == 0 && command->arg_count > 1)
+	{
+		if (profile_write_trace(command->args[1]) == -1)
+		{
+			printf("-%s: %s: %s\n", sysname, command->args[1], strerror(errno));
+			return UNKNOWN;
+		}
+		printf("%d events written to %s\n", profiler.event_count, command->args[1]);
+	}
+	else
+		printf("Usage: profile [on|off|show|reset|trace file]\n");
 	return SUCCESS;
 }
 
-int process_command(struct command_t *command);
-
-// Helper methods
-void save_directory();
-void update_records(int record);
-int get_record();
-
-int main()
+int builtin_bench(struct command_t *command)
 {
-	while (1)
+	if (command->arg_count > 0 && strcmp(command->args[0], "spawn") == 0)
+	{
+		int count = command->arg_count > 1 ? atoi(command->args[1]) : 10000;
+		return bench_spawn(count > 0 ? count : 10000);
+	}
+	if (command->arg_count > 0 && strcmp(command->args[0], "parse") == 0)
+	{
+		int lines = command->arg_count > 1 ? atoi(command->args[1]) : 1000000;
+		return bench_parse(lines > 0 ? lines : 1000000);
+	}
+	if (command->arg_count > 0 && strcmp(command->args[0], "lex") == 0)
+	{
+		int lines = command->arg_count > 1 ? atoi(command->args[1]) : 100000;
+		return bench_lex(lines > 0 ? lines : 100000);
+	}
+	if (command->arg_count > 1 && strcmp(command->args[0], "grep") == 0)
+		return bench_grep(command->args[1], command->arg_count > 2 ? command->args[2] : ".");
+	if (command->arg_count > 0 && strcmp(command->args[0], "shadow") == 0)
 	{
-		struct command_t *command = malloc(sizeof(struct command_t));
-		memset(command, 0, sizeof(struct command_t)); // set all bytes to 0
+		int count = command->arg_count > 1 ? atoi(command->args[1]) : 5000;
+		return bench_shadow(count > 0 ? count : 5000);
+	}
+	if (command->arg_count > 1 && strcmp(command->args[0], "pstree") == 0)
+	{
+		int count = command->arg_count > 2 ? atoi(command->args[2]) : 10000;
+		int rounds = command->arg_count > 3 ? atoi(command->args[3]) : 10;
+		return bench_pstree(command->args[1], count > 0 ? count : 10000, rounds > 0 ? rounds : 10);
+	}
+	printf("Usage: bench spawn [count]\n");
+	printf("       bench parse [lines]\n");
+	printf("       bench lex [lines]\n");
+	printf("       bench grep text [directory]\n");
+	printf("       bench shadow [processes]\n");
+	printf("       bench pstree chain|fan|random [processes] [rounds]\n");
+	return SUCCESS;
+}
 
-		int code;
-		code = prompt(command);
-		if (code == EXIT)
-			break;
+int builtin_filesearch(struct command_t *command)
+{
+	if (command->arg_count > 0 && strcmp(command->args[0], "-I") == 0) // the indexer runs until the shell exits
+		command->background = true;
 
-		code = process_command(command);
-		if (code == EXIT)
-			break;
+	char cmdline[256];
+	describe_command(command, cmdline, sizeof(cmdline));
+	sigprocmask(SIG_BLOCK, &sigchld_mask, NULL);
+	struct job_t *job = job_create(cmdline, command->background);
+	if (job != NULL && command->arg_count > 0 && strcmp(command->args[0], "-I") == 0)
+		job->daemon = true;
+	pid_t pid = job != NULL ? job_fork(job) : -1;
 
-		free_command(command);
+	if (pid == 0) // child
+	{
+		fflush(stdout);
+		exit(file_search(command));
 	}
 
-	printf("\n");
-	return 0;
+	// Wait for child to finish if command is not running in background
+	if (job != NULL)
+		job_finish(job);
+	else
+		sigprocmask(SIG_UNBLOCK, &sigchld_mask, NULL);
+	return SUCCESS;
 }
 
-void save_directory()
+int builtin_cdh(struct command_t *command)
 {
+	struct dir_match directories[9];
+	bool list = command->arg_count > 0 && strcmp(command->args[0], "-l") == 0;
+	char **terms = command->args + list;
+	int term_count = command->arg_count - list;
+
 	/**
-	 * Writes current working directory to directory history
+	 * cdh foo jumps to the best directory matching foo
 	 */
-	pid_t pid = fork();
-	if (pid == 0) // child
+	if (term_count > 0 && !list)
 	{
-		int fd = open(directory_history, O_RDWR | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR);
-
-		dup2(fd, 1); // make stdout go to file
-		close(fd);
-
-		char *pwdargs[2];
-		pwdargs[0] = "pwd";
-		pwdargs[1] = NULL;
-
-		execv("/bin/pwd", pwdargs);
-		exit(0);
+		if (rank_directories(terms, term_count, directories, 1) == 0)
+		{
+			printf("-%s: %s: no directory matches\n", sysname, command->name);
+			return SUCCESS;
+		}
+		if (chdir(directories[0].path) == -1)
+			printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+		else
+			save_directory();
+		return SUCCESS;
 	}
-	else // parent
-		wait(NULL);
-}
+	int dirCounter = rank_directories(terms, term_count, directories, 9);
 
-void update_records(int record)
-{
 	/**
-	 * Updates records file with new record
+	 * Prints directory history to terminal, best first
 	 */
-	pid_t pid = fork();
-	if (pid == 0) // child
+	for (int i = 0; i < dirCounter; i++)
 	{
-		/**
-		 * Reset the records file
-		 */
-		char *resetArgs[5];
-		resetArgs[0] = "truncate";
-		resetArgs[1] = "-s";
-		resetArgs[2] = "0";
-		resetArgs[3] = records;
-		resetArgs[4] = NULL;
-		execv("/bin/truncate", resetArgs);
+		if (list)
+			printf("%-8.1f %s\n", directories[i].score, directories[i].path);
+		else
+			printf("%c %d) %s\n", 'a' + i, i + 1, directories[i].path);
 	}
-	else
+	if (dirCounter == 0)
 	{
-		/**
-		 * Write record to records file
-		 */
-		wait(NULL);
-		FILE *file = fopen(records, "w");
-		if (file == NULL)
-			printf("Could not open records file.");
-		else
-			fprintf(file, "%d", record);
-		fclose(file);
+		printf("Directory history is empty.\n");
+		return SUCCESS;
 	}
-}
+	if (list)
+		return SUCCESS;
 
-int get_record()
-{
 	/**
-	 * Return current hotandcold record
+	 * Gets user input to change directory
+	 * Changes directory
+	 * Updates directory history
 	 */
-	int record;
-	FILE *file = fopen(records, "r");
-	fscanf(file, "%d", &record);
-	fclose(file);
-	return record;
-}
-
-
-int process_command(struct command_t *command)
-{
-	int r;
-	if (strcmp(command->name, "") == 0)
+	char input[16];
+	printf("Select directory by letter or number: ");
+	fflush(stdout);
+	terminal_cooked();
+	if (fgets(input, sizeof(input), stdin) == NULL)
 		return SUCCESS;
 
-	if (strcmp(command->name, "exit") == 0)
-		return EXIT;
-
-	if (strcmp(command->name, "cd") == 0)
+	for (int i = 0; i < dirCounter; i++)
 	{
-		if (command->arg_count > 0)
+		if (input[0] == 'a' + i || atoi(input) == i + 1)
 		{
-			r = chdir(command->args[0]);
-			if (r == -1)
+			if (chdir(directories[i].path) == -1)
 				printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
-			// This part is for the cdh implementation
 			else
 				save_directory();
-
 			return SUCCESS;
 		}
 	}
+	return SUCCESS;
+}
 
-
-
-	// TODO: Implement your custom commands here
-	if (strcmp(command->name, "filesearch") == 0)
+int builtin_take(struct command_t *command)
+{
+	/**
+	 * Creates directory if does not exist
+	 */
+	if (make_directories(command->args[0]) == -1)
 	{
-		if (command->arg_count > 0)
-		{
-			pid_t pid = fork();
-
-			if (pid == 0) // child
-			{
-				int recursiveFlag = 0;
-				int openFileFlag = 0;
-				for (int i = 0; i < command->arg_count - 1; i++) // Update flags
-				{
-					if (strcmp(command->args[i], "-r") == 0)
-						recursiveFlag = 1;
-					if (strcmp(command->args[i], "-o") == 0)
-						openFileFlag = 1;
-				}
-
-				char fileName[100] = "*";
-				strcat(fileName, command->args[command->arg_count - 1]);
-				strcat(fileName, "*");
-
-				char *args[command->arg_count + 2];
-				int counter = 0;
-				args[counter++] = "find";
-				if (!recursiveFlag) // Do not check subfolders
-				{
-					args[counter++] = "-maxdepth";
-					args[counter++] = "1";
-				}
-				args[counter++] = "-name";
-				args[counter++] = fileName;
-				args[counter++] = NULL;
-
-				if (!openFileFlag)
-					execv("/bin/find", args);
-
-				if (openFileFlag)
-				{
-					int link[2];
-					char foo[1024];
-
-					if (pipe(link) == -1)
-						printf("Pipe failed\n");
-
-					pid = fork();
-
-					if (pid == 0) // child
-					{
-						dup2(link[1], STDOUT_FILENO);
-						close(link[0]);
-						close(link[1]);
-						execv("/bin/find", args);
-					}
-
-					else // parent
-					{
-						close(link[1]);
-						int nbytes = read(link[0], foo, sizeof(foo));
-						// printf("Output: (%.*s)\n", nbytes, foo);
-						// printf("Bytes: %d\n", nbytes);
-
-						if (nbytes == 0)
-						{
-							printf("Could not find a file.\n");
-							exit(0);
-						}
-
-						char fileNames[nbytes + 10];
-						strncpy(fileNames, foo, nbytes);
-
-						char *argsForOpen[15];
-						argsForOpen[0] = "cat";
-						int fileCounter = 1;
-
-						char *fileName = strtok(fileNames, "\n");
-						argsForOpen[fileCounter++] = fileName;
-						while (fileName != NULL)
-						{
-							fileName = strtok(NULL, "\n");
-							argsForOpen[fileCounter++] = fileName;
-						}
-
-						execv("/bin/cat", argsForOpen);
-						return 0;
-					}
-					return SUCCESS;
-				}
-			}
-			else
-			{
-				// Wait for child to finish if command is not running in background
-				if (command->args[command->arg_count - 1] != "&")
-					wait(NULL);
-				return SUCCESS;
-			}
-		}
-		wait(NULL);
+		printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
 		return SUCCESS;
 	}
 
-	if (strcmp(command->name, "cdh") == 0)
-	{
-		int link[2];
-		char foo[1024];
-
-		if (pipe(link) == -1)
-			printf("Pipe failed\n");
-
-		pid_t pid = fork();
-
-		if (pid == 0) // A.child
-		{
-			/**
-			 * Writes the directory history into pipe
-			 */
-			dup2(link[1], STDOUT_FILENO);
-			close(link[0]);
-			close(link[1]);
-			char *tacargs[3];
-			tacargs[0] = "tac";
-			tacargs[1] = directory_history;
-			tacargs[2] = NULL;
-			execv("/bin/tac", tacargs);
-		}
-		else // A.parent
-		{
-			/**
-			 * Reads the directory history from pipe
-			 */
-			wait(NULL);
-			close(link[1]);
-			int nbytes = read(link[0], foo, sizeof(foo));
-			int dirCounter = 0;
-			char *directories[10];
-			char *dirName = strtok(foo, "\n");
-
-			directories[dirCounter++] = dirName;
-			while (dirName != NULL && dirCounter < 10)
-			{
-				dirName = strtok(NULL, "\n");
-				directories[dirCounter++] = dirName;
-			}
+	/**
+	 * Changes directory
+	 * Updates directory history
+	 */
+	if (chdir(command->args[0]) == -1)
+		printf("-%s: %s: %s\n", sysname, "cd", strerror(errno));
+	else
+		save_directory();
+	return SUCCESS;
+}
 
-			/**
-			 * Prints directory history to terminal
-			 */
-			for (int i = 0; i < dirCounter - 1; i++)
-			{
-				printf("%c %d) %s\n", 'a' + i, i + 1, directories[i]);
-			}
+int builtin_joker(struct command_t *command)
+{
+	/**
+	 * Opens temporary file to schedule crontab task
+	 */
+	FILE *file = fopen("cronFile", "w");
+	fprintf(file, "*/15 * * * *  XDG_RUNTIME_DIR=/run/user/$(id -u) notify-send \"$(curl https://icanhazdadjoke.com)\"\n");
+	fclose(file);
 
-			int inputLimit = 2;
-			int fd[2];
-			char input[inputLimit];
+	/**
+	 * Schedules crontab task
+	 */
+	char *cronArgs[3];
+	cronArgs[0] = "crontab";
+	cronArgs[1] = "cronFile";
+	cronArgs[2] = NULL;
+	run_process("/bin/crontab", cronArgs, NULL);
 
-			if (pipe(fd) == -1)
-				printf("Pipe failed\n");
+	/**
+	 * Removes temporary file
+	 */
+	char *removeArgs[3];
+	removeArgs[0] = "rm";
+	removeArgs[1] = "cronFile";
+	removeArgs[2] = NULL;
+	run_process("/bin/rm", removeArgs, NULL);
+	return SUCCESS;
+}
 
-			pid = fork();
-			if (pid == 0) // Child
-			{
-				/**
-				 * Gets user input to change directory
-				 * Writes it to pipe
-				 */
-				printf("Select directory by letter or number: ");
-				fgets(input, inputLimit, stdin); // Get string input
-				write(fd[1], input, sizeof(inputLimit));
-				close(fd[0]);
-				exit(0);
-			}
+int builtin_joke(struct command_t *command)
+{
+	/**
+	 * Prints one joke
+	 */
+	char *curlArgs[3];
+	curlArgs[0] = "curl";
+	curlArgs[1] = "https://icanhazdadjoke.com";
+	curlArgs[2] = NULL;
 
-			else // Parent
-			{
-				/**
-				 * Reads user input from pipe
-				 * Changes directory
-				 * Updates directory history
-				 */
-				wait(NULL);
-				read(fd[0], input, sizeof(inputLimit));
+	run_process("/bin/curl", curlArgs, NULL);
+	printf("\n");
+	return SUCCESS;
+}
 
-				for (int i = 0; i < dirCounter - 1; i++)
-				{
-					if (input[0] == 'a' + i || atoi(input) == i + 1)
-					{
-						r = chdir(directories[i]);
-						save_directory();
-						return SUCCESS;
-					}
-				}
-			}
-		}
-	}
+int builtin_hotandcold(struct command_t *command)
+{
+	/**
+	 * Takes guesses from user
+	 * If got closer, prints hotter
+	 * If got further, prints closer
+	 */
+	sigprocmask(SIG_BLOCK, &sigchld_mask, NULL);
+	struct job_t *job = job_create(command->name, false);
+	pid_t pid = job != NULL ? job_fork(job) : -1;
 
-	if (strcmp(command->name, "take") == 0)
+	if (pid == 0) // child
 	{
-		if (command->arg_count == 1)
+		int guess, distance, counter, record;
+		counter = 0;
+		srand(time(NULL));		  // Init rand
+		int r = rand() % 100 + 1; // from 1 to 100
+		printf("Make a guess from 1 to 100: ");
+		scanf("%d", &guess);
+		counter++;
+		distance = 100;
+
+		while (guess != r)
 		{
-			pid_t pid = fork();
+			// got closer
+			if (abs(guess - r) <= distance)
+				printf("Getting hot!\n");
+			else // got further
+				printf("Getting cold!\n");
 
-			if (pid == 0) // child
-			{
-				/**
-				 * Creates directory if does not exist
-				 */
-				char *mkdirArgs[4];
-				mkdirArgs[0] = "mkdir";
-				mkdirArgs[1] = "-p";
-				mkdirArgs[2] = command->args[0];
-				mkdirArgs[3] = NULL;
-				execv("/bin/mkdir", mkdirArgs);
-			}
+			distance = abs(guess - r);
 
-			else
-			{
-				/**
-				 * Changes directory
-				 * Updates directory history
-				 */
-				wait(NULL);
-				char *cdArgs[2];
-				cdArgs[0] = "cd";
-				cdArgs[1] = command->args[0];
-				r = chdir(command->args[0]);
-				if (r == -1)
-					printf("-%s: %s: %s\n", sysname, "cd", strerror(errno));
-				else
-					save_directory();
-			}
+			printf("Make a guess: ");
+			scanf("%d", &guess);
+			counter++;
 		}
-	}
-	
-	if (strcmp(command->name, "joker") == 0)
-	{
-		/**
-		 * Opens temporary file to schedule crontab task
-		 */
-		FILE *file = fopen("cronFile", "w");
-		fprintf(file, "*/15 * * * *  XDG_RUNTIME_DIR=/run/user/$(id -u) notify-send \"$(curl https://icanhazdadjoke.com)\"\n");
-		fclose(file);
+		printf("You guessed in %d tries.\n", counter);
 
-		pid_t pid = fork();
-		if (pid == 0) // child
-		{
-			/**
-			 * Schedules crontab task
-			 */
-			char *cronArgs[3];
-			cronArgs[0] = "crontab";
-			cronArgs[1] = "cronFile";
-			cronArgs[2] = NULL;
-			execv("/bin/crontab", cronArgs);
-			exit(0);
-		}
-		else
+		// Check if it is a new record
+		record = get_record();
+
+		// New Record
+		if ((counter < record) || (record == -1))
 		{
-			wait(NULL);
-			pid = fork();
-			if (pid == 0) // child
-			{
-				/**
-				 * Removes temporary file
-				 */
-				char *removeArgs[3];
-				removeArgs[0] = "rm";
-				removeArgs[1] = "cronFile";
-				removeArgs[2] = NULL;
-				execv("/bin/rm", removeArgs);
-				exit(0);
-			}
-			else // parent
-			{
-				wait(NULL);
-				return SUCCESS;
-			}
+			printf("Congratulations! That's a new record!\n");
+			update_records(counter);
 		}
+		exit(0);
 	}
-
-	if (strcmp(command->name, "joke") == 0)
+	else
 	{
-		/**
-		 * Prints one joke
-		 */
-		pid_t pid = fork();
-
-		if (pid == 0) // child
-		{
-			char *curlArgs[3];
-			curlArgs[0] = "curl";
-			curlArgs[1] = "https://icanhazdadjoke.com";
-			curlArgs[2] = NULL;
-
-			execv("/bin/curl", curlArgs);
-		}
+		if (job != NULL)
+			job_finish(job);
 		else
-		{
-			wait(NULL);
-			printf("\n");
-		}
+			sigprocmask(SIG_UNBLOCK, &sigchld_mask, NULL);
 		return SUCCESS;
 	}
-	
-	if (strcmp(command->name, "hotandcold") == 0)
-	{
-		/**
-		 * Takes guesses from user
-		 * If got closer, prints hotter
-		 * If got further, prints closer
-		 */
-		pid_t pid = fork();
-
-		if (pid == 0) // child
-		{
-			int guess, distance, counter, record;
-			counter = 0;
-			srand(time(NULL));		  // Init rand
-			int r = rand() % 100 + 1; // from 1 to 100
-			printf("Make a guess from 1 to 100: ");
-			scanf("%d", &guess);
-			counter++;
-			distance = 100;
-
-			while (guess != r)
-			{
-				// got closer
-				if (abs(guess - r) <= distance)
-					printf("Getting hot!\n");
-				else // got further
-					printf("Getting cold!\n");
-
-				distance = abs(guess - r);
-
-				printf("Make a guess: ");
-				scanf("%d", &guess);
-				counter++;
-			}
-			printf("You guessed in %d tries.\n", counter);
-
-			// Check if it is a new record
-			record = get_record();
+}
 
-			// New Record
-			if ((counter < record) || (record == -1))
-			{
-				printf("Congratulations! That's a new record!\n");
-				update_records(counter);
-			}
-			exit(0);
-		}
-		else
-		{
-			wait(NULL);
-			return SUCCESS;
-		}
-	}
+int builtin_resetrecord(struct command_t *command)
+{
+	update_records(-1);
+	printf("The record is reset.\n");
+	return SUCCESS;
+}
 
-	if (strcmp(command->name, "resetrecord") == 0)
+int builtin_pstraverse(struct command_t *command)
+{
+	bool usage = strcmp(command->args[1], "-a") == 0;
+	if (strcmp(command->args[1], "-b") != 0 && strcmp(command->args[1], "-d") != 0 && !usage) // If not -b, -d or -a
 	{
-		update_records(-1);
-		printf("The record is reset.\n");
+		printf("Invalid input.\n");
 		return SUCCESS;
 	}
 
-	if (strcmp(command->name, "pstraverse") == 0)
+	/**
+	 * Filter flags go anywhere after the mode, only -a takes a top count and then a sort key
+	 */
+	struct pstraverse_filter filter = {.max_depth = -1, .uid = -1};
+	int top = 0, positional = 0;
+	const char *key = "cpu";
+	for (int i = 2; i < command->arg_count; i++)
 	{
-		if (command->arg_count != 2) // Require two parameters
+		char *arg = command->args[i];
+		bool has_value = i + 1 < command->arg_count;
+		if (strcmp(arg, "-t") == 0)
+			filter.threads = true;
+		else if (strcmp(arg, "-p") == 0)
+			filter.prune = true;
+		else if (strcmp(arg, "-D") == 0 && has_value)
+			filter.max_depth = atoi(command->args[++i]);
+		else if (strcmp(arg, "-c") == 0 && has_value)
+			snprintf(filter.comm, sizeof(filter.comm), "%s", command->args[++i]);
+		else if (strcmp(arg, "-u") == 0 && has_value)
+			filter.uid = atoi(command->args[++i]);
+		else if (strcmp(arg, "-s") == 0 && has_value)
+			snprintf(filter.states, sizeof(filter.states), "%s", command->args[++i]);
+		else if (usage && positional == 0 && isdigit((unsigned char)arg[0]))
 		{
-			printf("Invalid input.\n");
-			return SUCCESS;
+			top = atoi(arg);
+			positional++;
 		}
-
-		if (strcmp(command->args[1], "-b") != 0 && strcmp(command->args[1], "-d") != 0) // If not -b or -d
+		else if (usage && positional == 1 && (strcmp(arg, "cpu") == 0 || strcmp(arg, "rss") == 0 || strcmp(arg, "threads") == 0))
 		{
-			printf("Invalid input.\n");
-			return SUCCESS;
+			key = arg;
+			positional++;
 		}
-
-		pid_t pid = fork();
-
-		if (pid == 0) // child
+		else
 		{
-			char *sudoDmesgArgs[4];
-			sudoDmesgArgs[0] = "sudo";
-			sudoDmesgArgs[1] = "dmesg";
-			sudoDmesgArgs[2] = "-C";
-			sudoDmesgArgs[3] = NULL;
-			execv("/bin/sudo", sudoDmesgArgs);
-			exit(0);
-		}
-		else // parent
-		{
-			wait(NULL);
-			pid = fork();
-			if (pid == 0) // child
-			{
-				/**
-				 * Calls insmod line with parameters
-				 */
-				char pid[10] = "PID=";
-				char *pidVal = command->args[0];
-				strcat(pid, pidVal);
-
-				char traverse[20] = "traverseType=\"";
-				char *traverseVal = command->args[1];
-				strcat(traverse, traverseVal);
-				strcat(traverse, "\"");
-
-				char *insmodArgs[6];
-				insmodArgs[0] = "sudo";
-				insmodArgs[1] = "insmod";
-				insmodArgs[2] = "my_module.ko";
-				insmodArgs[3] = pid;
-				insmodArgs[4] = traverse;
-				insmodArgs[5] = NULL;
-				execv("/bin/sudo", insmodArgs);
-				exit(0);
-			}
-			else // parent
-			{
-				wait(NULL);
-				pid = fork();
-				if (pid == 0) // child
-				{
-					char *rmmodArgs[4];
-					rmmodArgs[0] = "sudo";
-					rmmodArgs[1] = "rmmod";
-					rmmodArgs[2] = "my_module.ko";
-					rmmodArgs[3] = NULL;
-					execv("/bin/sudo", rmmodArgs);
-					exit(0);
-				}
-				else // parent
-				{
-					wait(NULL);
-					pid = fork();
-					if (pid == 0) // child
-					{
-						char *dmesg[2];
-						dmesg[0] = "dmesg";
-						dmesg[1] = NULL;
-						execv("/bin/dmesg", dmesg);
-						exit(0);
-					}
-					else // parent
-					{
-						wait(NULL);
-						return SUCCESS;
-					}
-				}
-			}
+			printf("Invalid input.\n");
+			return SUCCESS;
 		}
 	}
 
-	
-	
-	// Custom commands until here
-
-	pid_t pid = fork();
-
-	if (pid == 0) // child
+	/**
+	 * One write of "PID -b|-d|-a [top key] [options]" to the module, the result is copied to stdout as it is read
+	 * Without the module the same lines come from /proc
+	 */
+	int fd = open_pstraverse();
+	if (fd == -1)
 	{
-		// increase args size by 2
-		command->args = (char **)realloc(
-			command->args, sizeof(char *) * (command->arg_count += 2));
-
-		// shift everything forward by 1
-		for (int i = command->arg_count - 2; i > 0; --i)
-			command->args[i] = command->args[i - 1];
-
-		// set args[0] as a copy of name
-		command->args[0] = strdup(command->name);
-		// set args[arg_count-1] (last) to NULL
-		command->args[command->arg_count - 1] = NULL;
-
-		// TODO: do your own exec with path resolving using execv()
-
-		char path[] = "/bin/";
-		strcat(path, command->name);
-
-		execv(path, command->args);
-		exit(0);
+		char *end;
+		long pid = strtol(command->args[0], &end, 10);
+		int err = EINVAL;
+		if (*end == 0 && end != command->args[0] && pid >= 0)
+			err = proc_traverse(pid, command->args[1], top, key, &filter);
+		if (err != 0)
+			printf("-%s: %s: %s: %s\n", sysname, command->name, command->args[0], strerror(err));
+		return SUCCESS;
 	}
-	else
+
+	char request[128], buf[65536]; // the module takes up to 127 bytes
+	int len = snprintf(request, sizeof(request), "%s %s", command->args[0], command->args[1]);
+	if (usage)
+		len += snprintf(request + len, sizeof(request) - len, " %d %s", top, key);
+	if (filter.max_depth >= 0 && len < (int)sizeof(request))
+		len += snprintf(request + len, sizeof(request) - len, " depth=%d", filter.max_depth);
+	if (filter.comm[0] != 0 && len < (int)sizeof(request))
+		len += snprintf(request + len, sizeof(request) - len, " comm=%s", filter.comm);
+	if (filter.uid != -1 && len < (int)sizeof(request))
+		len += snprintf(request + len, sizeof(request) - len, " uid=%d", filter.uid);
+	if (filter.states[0] != 0 && len < (int)sizeof(request))
+		len += snprintf(request + len, sizeof(request) - len, " state=%s", filter.states);
+	if (len < (int)sizeof(request))
+		len += snprintf(request + len, sizeof(request) - len, "%s%s\n", filter.threads ? " threads=1" : "", filter.prune ? " prune=1" : "");
+	if (len >= (int)sizeof(request))
 	{
-		// TODO: Wait for child to finish if command is not running in background
-		if (command->args[command->arg_count - 1] != "&")
-		{
-			wait(NULL);
-		}
+		printf("Invalid input.\n");
+		close(fd);
 		return SUCCESS;
 	}
+	ssize_t nbytes = write(fd, request, len);
+	fflush(stdout);
+	while (nbytes != -1 && (nbytes = read(fd, buf, sizeof(buf))) > 0)
+		write_all(STDOUT_FILENO, buf, nbytes);
+	if (nbytes == -1) // EINVAL for a bad PID, ESRCH for no such process
+		printf("-%s: %s: %s: %s\n", sysname, command->name, command->args[0], strerror(errno));
+	close(fd);
+	return SUCCESS;
+}
+
+void register_builtins()
+{
+	register_builtin("exit", builtin_exit, 0, 1, "exit [status]");
+	register_builtin("cd", builtin_cd, 0, 1, "cd [directory]");
+	register_builtin("hash", builtin_hash, 0, -1, "hash [-r] [command...]");
+	register_builtin("jobs", builtin_jobs, 0, 0, "jobs");
+	register_builtin("fg", builtin_fg, 0, 1, "fg [%job]");
+	register_builtin("bg", builtin_fg, 0, 1, "bg [%job]");
+	register_builtin("wait", builtin_wait, 0, 1, "wait [%job]");
+	register_builtin("zerocopy", builtin_zerocopy, 0, 1, "zerocopy [on|off]");
+	register_builtin("profile", builtin_profile, 0, 2, "profile [on|off|show|reset|trace file]");
+	register_builtin("bench", builtin_bench, 0, 4, "bench spawn|parse|lex|grep|shadow|pstree ...");
 
-	printf("-%s: %s: command not found\n", sysname, command->name);
-	return UNKNOWN;
+	// Custom commands
+	register_builtin("filesearch", builtin_filesearch, 0, -1, filesearch_usage);
+	register_builtin("cdh", builtin_cdh, 0, -1, "cdh [-l] [term...]");
+	register_builtin("take", builtin_take, 1, 1, "take directory");
+	register_builtin("joker", builtin_joker, 0, 0, "joker");
+	register_builtin("joke", builtin_joke, 0, 0, "joke");
+	register_builtin("hotandcold", builtin_hotandcold, 0, 0, "hotandcold");
+	register_builtin("resetrecord", builtin_resetrecord, 0, 0, "resetrecord");
+	register_builtin("pstraverse", builtin_pstraverse, 2, -1,
+					 "pstraverse PID -b|-d|-a [top] [cpu|rss|threads] [-D depth] [-c comm|^prefix] [-u uid] [-s states] [-t] [-p]");
 }
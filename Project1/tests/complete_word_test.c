@@ -0,0 +1,54 @@
+/**
+ * complete_word against a PATH of one directory holding true and truefoo
+ * Built with shellfyre.c itself, its main renamed, by make check
+ */
+#define main shellfyre_main
+#include "../shellfyre.c"
+#undef main
+
+int failures = 0;
+
+void expect(const char *word, int expected)
+{
+	char *items[COMPLETION_MAX];
+	int display_offset;
+	int count = complete_word(word, true, items, &display_offset);
+	if (count != expected)
+	{
+		printf("FAIL: %s completes to %d names, expected %d\n", word, count, expected);
+		failures++;
+	}
+}
+
+int main()
+{
+	char dir[] = "/tmp/complete_word_test.XXXXXX";
+	if (mkdtemp(dir) == NULL)
+		return 1;
+	char path[64];
+	const char *names[] = {"true", "truefoo"};
+	for (int i = 0; i < 2; i++)
+	{
+		snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+		close(open(path, O_WRONLY | O_CREAT, 0755));
+	}
+	setenv("PATH", dir, 1);
+	register_builtins();
+
+	expect("tru", 2);
+	expect("true", 2);
+	expect("truefoo", 1);
+	expect("truex", 0);	   // runs past the leaf of true
+	expect("truefoox", 0); // runs past the leaf of truefoo
+	expect("cdhzz", 0);	   // runs past the builtin cdh
+	expect("zz", 0);
+
+	for (int i = 0; i < 2; i++)
+	{
+		snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+		unlink(path);
+	}
+	rmdir(dir);
+	printf("%s\n", failures == 0 ? "complete_word: all passed" : "complete_word: failed");
+	return failures != 0;
+}